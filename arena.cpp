@@ -0,0 +1,126 @@
+/* Arena allocation of the project objects
+ *
+ * Copyright (C) 2017 Aleksi Salmela
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <new>
+
+#include "arena.h"
+
+namespace Tasker {
+namespace Backend {
+
+const size_t Arena::BLOCK_SIZE;
+thread_local Arena *Arena::sCurrent = NULL;
+
+/// Arena::Scope
+
+Arena::Scope::Scope(Arena *arena)
+	:mPrevious(sCurrent)
+{
+	sCurrent = arena;
+}
+
+Arena::Scope::~Scope()
+{
+	sCurrent = mPrevious;
+}
+
+/// Arena
+
+Arena::Arena()
+	:mPos(NULL), mEnd(NULL), mFree()
+{
+}
+
+// The objects must have been destroyed, only their memory is freed here
+Arena::~Arena()
+{
+	for(char *block : mBlocks) {
+		::operator delete(block);
+	}
+}
+
+void *Arena::allocate(size_t size)
+{
+	size = (size + SIZE_CLASS - 1) / SIZE_CLASS * SIZE_CLASS;
+	std::lock_guard<std::mutex> lock(mMutex);
+	if(size <= MAX_POOLED) {
+		FreeNode *&node = mFree[size / SIZE_CLASS - 1];
+		if(node) {
+			void *p = node;
+			node = node->next;
+			return p;
+		}
+	}
+	if(size > (size_t)(mEnd - mPos)) {
+		size_t blockSize = std::max(size, BLOCK_SIZE);
+		mPos = (char*)::operator new(blockSize);
+		mEnd = mPos + blockSize;
+		mBlocks.push_back(mPos);
+	}
+	void *p = mPos;
+	mPos += size;
+	return p;
+}
+
+// The memory of the large objects is freed only with the arena
+void Arena::release(void *p, size_t size)
+{
+	size = (size + SIZE_CLASS - 1) / SIZE_CLASS * SIZE_CLASS;
+	if(size > MAX_POOLED) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mMutex);
+	FreeNode *node = (FreeNode*)p;
+	node->next = mFree[size / SIZE_CLASS - 1];
+	mFree[size / SIZE_CLASS - 1] = node;
+}
+
+size_t Arena::getBlockCount()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mBlocks.size();
+}
+
+// The owner arena is stored before the object so that the object can be
+// freed without knowing where it was allocated.
+void *Arena::allocateObject(size_t size)
+{
+	Arena *arena = sCurrent;
+	char *p = (char*)(arena ? arena->allocate(size + HEADER_SIZE) : ::operator new(size + HEADER_SIZE));
+	*(Arena**)p = arena;
+	return p + HEADER_SIZE;
+}
+
+void Arena::releaseObject(void *p, size_t size)
+{
+	if(!p) {
+		return;
+	}
+	char *base = (char*)p - HEADER_SIZE;
+	Arena *arena = *(Arena**)base;
+	if(arena) {
+		arena->release(base, size + HEADER_SIZE);
+	} else {
+		::operator delete(base);
+	}
+}
+
+};
+};
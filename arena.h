@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+
+namespace Tasker {
+namespace Backend {
+
+// Memory of the objects read from the project files. The memory is taken
+// from large blocks that are freed with the arena, the freed objects are
+// reused through free lists of size classes.
+class Arena
+{
+public:
+	static const size_t BLOCK_SIZE = 256 << 10;
+	static const size_t SIZE_CLASS = 16;
+	static const size_t MAX_POOLED = 1024;//< larger objects aren't reused
+
+	// The objects that the current thread allocates with allocateObject()
+	// are taken from the arena while the scope exists
+	class Scope
+	{
+	public:
+		Scope(Arena *arena);
+		~Scope();
+	private:
+		Arena *mPrevious;
+	};
+
+	Arena();
+	~Arena();
+	void *allocate(size_t size);
+	void release(void *p, size_t size);
+	size_t getBlockCount();
+
+	static void *allocateObject(size_t size);
+	static void releaseObject(void *p, size_t size);
+private:
+	struct FreeNode {
+		FreeNode *next;
+	};
+	static const size_t HEADER_SIZE = 16;//< owner arena of an object
+
+	std::vector<char*> mBlocks;
+	char *mPos, *mEnd;
+	FreeNode *mFree[MAX_POOLED / SIZE_CLASS];
+	std::mutex mMutex;
+
+	static thread_local Arena *sCurrent;
+};
+
+// Vector that keeps the first N elements inside the object. Only for
+// trivially copyable elements such as pointers.
+template<typename T, size_t N>
+class SmallVector
+{
+public:
+	SmallVector() :mData(mInline), mSize(0), mCapacity(N) {};
+	SmallVector(const SmallVector &other) :SmallVector() {*this = other;};
+	~SmallVector() {if(mData != mInline) delete[] mData;};
+
+	SmallVector &operator=(const SmallVector &other)
+	{
+		if(this != &other) {
+			clear();
+			for(const T &value : other) {
+				push_back(value);
+			}
+		}
+		return *this;
+	}
+
+	void push_back(const T &value)
+	{
+		if(mSize == mCapacity) {
+			T *data = new T[mCapacity * 2];
+			std::copy(mData, mData + mSize, data);
+			if(mData != mInline) delete[] mData;
+			mData = data;
+			mCapacity *= 2;
+		}
+		mData[mSize++] = value;
+	}
+
+	void clear() {mSize = 0;};
+	size_t size() const {return mSize;};
+	bool empty() const {return mSize == 0;};
+	T &operator[](size_t i) {return mData[i];};
+	const T &operator[](size_t i) const {return mData[i];};
+	T &back() {return mData[mSize - 1];};
+	const T &back() const {return mData[mSize - 1];};
+	T *begin() {return mData;};
+	T *end() {return mData + mSize;};
+	const T *begin() const {return mData;};
+	const T *end() const {return mData + mSize;};
+	operator std::vector<T>() const {return std::vector<T>(begin(), end());};
+private:
+	T *mData;
+	size_t mSize;
+	size_t mCapacity;
+	T mInline[N];
+};
+
+};
+};
@@ -20,33 +20,32 @@
 #include <algorithm>
 #include <exception>
 #include <fstream>
+#include <iostream>
 #include <sstream>
 #include <cstring>
 #include <ctime>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "backend.h"
 #include "git.h"
+#include "history.h"
+#include "cache.h"
+#include "journal.h"
+#include "version.h"
 
 namespace Tasker {
 namespace Backend {
 
-// From https://stackoverflow.com/questions/236129/236803#236803
-template<typename Out>
-void split(const std::string &str, char delim, Out result) {
-	std::stringstream ss;
-	ss.str(str);
-	std::string item;
-	while(std::getline(ss, item, delim)) {
-		*(result++) = item;
-	}
-}
-
-std::vector<std::string> split(const std::string &str, char delim) {
-	std::vector<std::string> elements;
-	split(str, delim, std::back_inserter(elements));
-	return elements;
-}
-
 /// User
 
 User User::ANONYMOUS_VALUE("anonymous");
@@ -91,13 +90,13 @@ void User::write(FJson::Writer &out) const
 }
 
 /// TaskState
-TaskState::TaskState(TaskType *type, std::string name)
+TaskState::TaskState(TaskType *type, Symbol name)
 	:mType(type), mName(name), mRefCount(0), mIsDeleted(false)
 {
 	mId = type ? type->useNextStateId(this) : TaskState::INVALID_ID;
 }
 
-TaskState::TaskState(TaskType *type, std::string name, unsigned int id)
+TaskState::TaskState(TaskType *type, Symbol name, unsigned int id)
 	:mType(type), mName(name), mRefCount(0), mIsDeleted(false)
 {
 	mId = type->useStateId(this, id);
@@ -118,6 +117,9 @@ void TaskState::ownedBy(const TaskType *type)
 void TaskState::rename(std::string newName)
 {
 	mName = newName;
+	if(mType) {
+		mType->markDirty();
+	}
 }
 
 std::string TaskState::getName() const
@@ -161,13 +163,14 @@ void TaskState::free()
 
 TaskState *TaskState::read(TaskType *type, FJson::Reader &in)
 {
-	std::string name, key;
+	std::string key;
+	Symbol name;
 	unsigned int id = TaskState::INVALID_ID;
 	FJson::TokenCache foreignKeys;
 	in.startObject();
 	while(in.readObjectKey(key)) {
 		if(key == "name") {
-			in.read(name);
+			name = Symbol::read(in);
 		} else if(key == "id") {
 			in.read(id);
 		} else {
@@ -196,7 +199,8 @@ void TaskState::write(FJson::Writer &out) const
 /// TaskType
 
 TaskType::TaskType(Project *project, std::string name)
-	:mProject(project), mName(name), mStartState(NULL)
+	:mProject(project), mName(name), mIsDeleted(false), mDirty(true),
+	mStartState(NULL)
 {
 	if(project) {
 		project->mTypes[name] = this;
@@ -213,6 +217,7 @@ TaskType::~TaskType()
 void TaskType::rename(std::string newName)
 {
 	mName = newName;
+	markDirty();
 }
 
 std::string TaskType::getName() const
@@ -236,6 +241,7 @@ void TaskType::setStartState(TaskState *state)
 	}
 	state->ref();
 	mStartState = state;
+	markDirty();
 }
 
 void TaskType::setEndStates(std::set<TaskState*> states)
@@ -249,6 +255,7 @@ void TaskType::setEndStates(std::set<TaskState*> states)
 	}
 
 	mEndStates = states;//TODO should we duplicate here
+	markDirty();
 }
 
 void TaskType::setTransition(TaskState *from, TaskState *to, bool create)
@@ -278,6 +285,7 @@ void TaskType::setTransition(TaskState *from, TaskState *to, bool create)
 			from->unref();
 		}
 	}
+	markDirty();
 }
 
 bool TaskType::canChange(TaskState *from, TaskState *to) const
@@ -309,6 +317,29 @@ bool TaskType::isIncomplete() const
 	return false;
 }
 
+bool TaskType::isDirty() const
+{
+	return mDirty;
+}
+
+// The state names and the closed states are in the task columns
+void TaskType::markDirty()
+{
+	mDirty = true;
+	if(mProject) {
+		auto *list = mProject->getTaskList();
+		list->invalidateTree();
+		for(auto task : list->all()) {
+			task->touchType(this);
+		}
+	}
+}
+
+void TaskType::markClean()
+{
+	mDirty = false;
+}
+
 TaskType *TaskType::read(Project *project, FJson::Reader &in)
 {
 	TaskType *type = new TaskType(NULL, "");
@@ -364,6 +395,7 @@ TaskType *TaskType::read(Project *project, FJson::Reader &in)
 		}
 		type->mStateMap[type->mStates[toArray.first]] = set;
 	}
+	type->mDirty = false;
 	return type;
 }
 
@@ -428,6 +460,7 @@ TaskState *TaskType::getStateById(unsigned int index) const
 unsigned int TaskType::useNextStateId(TaskState *state)
 {
 	mStates.push_back(state);
+	markDirty();
 	return mStates.size() - 1;
 }
 
@@ -436,91 +469,130 @@ unsigned int TaskType::useStateId(TaskState *state, unsigned int id)
 	auto newSize = std::max((unsigned int)mStates.size(), id + 1);
 	mStates.resize(newSize, NULL);
 	mStates[id] = state;
+	markDirty();
 	return id;
 }
 
 /// Date
 
-Date::Date(std::string date)
-{
-	mTime = new struct tm;
-	*mTime = {0};
-	strptime(date.c_str(), "%Y-%m-%dT%H:%M:%SZ", mTime);
+// The date is parsed by hand because strptime and timegm are slow. The
+// missing fields are zero.
+Date::Date(const std::string &date)
+{
+	int fields[6] = {1970, 1, 1, 0, 0, 0};
+	const char *c = date.c_str();
+	for(int i = 0; i < 6 && *c; i++) {
+		int value = 0;
+		bool digits = false;
+		for(; *c >= '0' && *c <= '9'; c++) {
+			value = value * 10 + *c - '0';
+			digits = true;
+		}
+		if(!digits) {
+			break;
+		}
+		fields[i] = value;
+		if(*c) {
+			c++;
+		}
+	}
+	int64_t days = daysFromCivil(fields[0], fields[1], fields[2]);
+	mTime = days * 86400 + fields[3] * 3600 + fields[4] * 60 + fields[5];
 }
 
-Date::Date(const Date &date)
+Date::Date()
+	:mTime(time(NULL))
 {
-	mTime = new struct tm;
-	*mTime = *date.mTime;
 }
 
-Date::Date()
+// Howard Hinnant's conversion between the proleptic Gregorian calendar
+// and the days since the epoch.
+int64_t Date::daysFromCivil(int64_t year, unsigned int month, unsigned int day)
 {
-	time_t t = time(NULL);
-	mTime = new struct tm;
-	gmtime_r(&t, mTime);
+	year -= month <= 2;
+	int64_t era = (year >= 0 ? year : year - 399) / 400;
+	unsigned int yearOfEra = year - era * 400;
+	unsigned int dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	unsigned int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+	return era * 146097 + dayOfEra - 719468;
 }
 
-Date::~Date()
+void Date::civilFromDays(int64_t days, struct tm *time)
 {
-	delete mTime;
+	time->tm_wday = days >= -4 ? (days + 4) % 7 : (days + 5) % 7 + 6;
+	days += 719468;
+	int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+	unsigned int dayOfEra = days - era * 146097;
+	unsigned int yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+	unsigned int dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+	unsigned int mp = (5 * dayOfYear + 2) / 153;
+	unsigned int month = mp < 10 ? mp + 3 : mp - 9;
+	int64_t year = yearOfEra + era * 400 + (month <= 2);
+	time->tm_mday = dayOfYear - (153 * mp + 2) / 5 + 1;
+	time->tm_mon = month - 1;
+	time->tm_year = year - 1900;
+	bool leap = year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+	time->tm_yday = mp < 10 ? dayOfYear + 59 + leap : dayOfYear - 306;
 }
 
 std::string Date::getMachineTime() const
 {
-	char buffer[24];
-	strftime(buffer, 24, "%Y-%m-%dT%H:%M:%SZ", mTime);
+	int64_t days = mTime >= 0 ? mTime / 86400 : (mTime - 86399) / 86400;
+	unsigned int seconds = mTime - days * 86400;
+	struct tm time;
+	civilFromDays(days, &time);
+	char buffer[64];// room for any int year
+	snprintf(buffer, sizeof(buffer), "%04d-%02d-%02dT%02u:%02u:%02uZ",
+		time.tm_year + 1900, time.tm_mon + 1, time.tm_mday,
+		seconds / 3600, seconds / 60 % 60, seconds % 60);
 	return buffer;
 }
 
+// The offset of the local time zone is looked up once per hour of the
+// time because the zone rules change only on the hour.
+long Date::getLocalOffset(time_t time)
+{
+	static thread_local time_t cachedHour = -1;
+	static thread_local long cachedOffset = 0;
+	time_t hour = time - time % 3600;
+	if(hour != cachedHour) {
+		struct tm local;
+		localtime_r(&hour, &local);
+		cachedOffset = local.tm_gmtoff;
+		cachedHour = hour;
+	}
+	return cachedOffset;
+}
+
 std::string Date::getFormattedTime(std::string format) const
 {
+	int64_t local = mTime + getLocalOffset(mTime);
+	int64_t days = local >= 0 ? local / 86400 : (local - 86399) / 86400;
+	unsigned int seconds = local - days * 86400;
+	struct tm time = {0};
+	civilFromDays(days, &time);
+	time.tm_hour = seconds / 3600;
+	time.tm_min = seconds / 60 % 60;
+	time.tm_sec = seconds % 60;
 	char buffer[80];
-	time_t val = mktime(mTime);
-	strftime(buffer, 80, format.c_str(), localtime(&val));
+	strftime(buffer, 80, format.c_str(), &time);
 	return buffer;
 }
 
-int Date::cmp(const Date &other) const
-{
-	int delta = mTime->tm_year - other.mTime->tm_year;
-	if(delta != 0) {
-		return delta;
-	}
-	delta = mTime->tm_mon - other.mTime->tm_mon;
-	if(delta != 0) {
-		return delta;
-	}
-	delta = mTime->tm_mday - other.mTime->tm_mday;
-	if(delta != 0) {
-		return delta;
-	}
-	delta = mTime->tm_hour - other.mTime->tm_hour;
-	if(delta != 0) {
-		return delta;
-	}
-	delta = mTime->tm_min - other.mTime->tm_min;
-	if(delta != 0) {
-		return delta;
-	}
-	return mTime->tm_sec - other.mTime->tm_sec;
-}
+/// TaskEvent
 
-Date &Date::operator=(const Date &other)
+TaskEvent::TaskEvent(Kind kind)
+	:mKind(kind), mUser(User::ANONYMOUS), mTask(NULL)
 {
-	*mTime = *other.mTime;
-	return *this;
 }
 
-/// TaskEvent
-
-TaskEvent::TaskEvent()
-	:mUser(User::ANONYMOUS), mTask(NULL)
+TaskEvent::TaskEvent(Kind kind, Task *task)
+	:mKind(kind), mUser(User::ANONYMOUS), mTask(task)
 {
 }
 
-TaskEvent::TaskEvent(Task *task)
-	:mUser(User::ANONYMOUS), mTask(task)
+TaskEvent::TaskEvent(Kind kind, Task *task, const Date &date)
+	:mKind(kind), mUser(User::ANONYMOUS), mTask(task), mDate(date)
 {
 }
 
@@ -528,44 +600,91 @@ TaskEvent::~TaskEvent() {}
 
 TaskEvent *TaskEvent::read(Project *project, FJson::Reader &in)
 {
-	std::string typeStr;
-
-	FJson::AssocArray obj(&in);
-	FJson::Reader type(obj.get("type"));
-	type.read(typeStr);
-
-	TaskEvent *event;
-	//TODO use factory
-	if(typeStr == "STATE_CHANGE") {
-		event = new StateChangeEvent();
-	} else if(typeStr == "COMMENT") {
-		event = new CommentEvent();
-	} else if(typeStr == "TASK_REF") {
-		event = new ReferenceEvent();
-	} else if(typeStr == "COMMIT_REF") {
-		event = new CommitEvent();
-	} else {
+	// The type is written first so the other fields are usually read
+	// straight to the event. Only the subclass fields before the type are
+	// buffered.
+	TaskEvent *event = NULL;
+	User *user = User::ANONYMOUS;
+	Date date;
+	std::vector<std::pair<std::string, FJson::TokenCache> > early;
+	std::string key;
+	in.startObject();
+	try {
+		while(in.readObjectKey(key)) {
+			if(key == "type") {
+				event = create(Symbol::read(in));
+				for(auto &field : early) {
+					FJson::Reader value(&field.second);
+					if(!event->readInternal(value, field.first)) {
+						event->mForeignKeys.recordKey(field.first, field.second);
+					}
+				}
+			} else if(key == "user") {
+				user = project->getUser(Symbol::read(in));
+			} else if(key == "date") {
+				std::string time;
+				in.read(time);
+				date = Date(time);
+			} else if(!event) {
+				early.emplace_back(key, FJson::TokenCache());
+				in.skipValue(&early.back().second);
+			} else if(!event->readInternal(in, key)) {
+				in.skipValue(&event->mForeignKeys, true);
+			}
+		}
+	} catch(...) {
+		delete event;
+		throw;
+	}
+	if(!event) {
 		throw "Unknown event type";
 	}
+	event->mUser = user;
+	event->mDate = date;
+	return event;
+}
 
-	for(auto pair : obj.getValues()) {
-		auto key = pair.first;
-		FJson::Reader value(pair.second);
-		if(key == "type") {
-			continue;
-		} else if(key == "user") {
-			std::string name;
-			value.read(name);
-			event->mUser = project->getUser(name);
-		} else if(key == "date") {
-			std::string time;
-			value.read(time);
-			event->mDate = Date(time);
-		} else if(!event->readInternal(value, key)) {
-			value.skipValue(&event->mForeignKeys, true);
+template<typename T>
+static TaskEvent *createEvent()
+{
+	return new T();
+}
+
+// The stored name and the constructor of each kind in the order of the
+// kinds
+const TaskEvent::KindInfo *TaskEvent::getKinds()
+{
+	static const KindInfo kinds[KIND_COUNT] = {
+		{"STATE_CHANGE", createEvent<StateChangeEvent>},
+		{"COMMENT", createEvent<CommentEvent>},
+		{"TASK_REF", createEvent<ReferenceEvent>},
+		{"COMMIT_REF", createEvent<CommitEvent>}
+	};
+	return kinds;
+}
+
+TaskEvent *TaskEvent::create(Symbol type)
+{
+	const KindInfo *kinds = getKinds();
+	for(int kind = 0; kind < KIND_COUNT; kind++) {
+		if(kinds[kind].name == type) {
+			return kinds[kind].create();
 		}
 	}
-	return event;
+	throw "Unknown event type";
+}
+
+TaskEvent *TaskEvent::create(Kind kind)
+{
+	if(kind < 0 || kind >= KIND_COUNT) {
+		throw "Unknown event type";
+	}
+	return getKinds()[kind].create();
+}
+
+std::string TaskEvent::getName() const
+{
+	return getKinds()[mKind].name;
 }
 
 void TaskEvent::write(FJson::Writer &out) const
@@ -619,7 +738,7 @@ Task *TaskEvent::getTask() const
 }
 
 StateChangeEvent::StateChangeEvent(Task *task, TaskState *from, TaskState *to)
-	:TaskEvent(task)
+	:TaskEvent(KIND, task)
 {
 	mFromState = from->getId();
 	mToState = to->getId();
@@ -658,7 +777,7 @@ void StateChangeEvent::writeEvent(FJson::Writer &out) const
 }
 
 CommentEvent::CommentEvent(Task *task, std::string content)
-	:TaskEvent(task), mContent(content)
+	:TaskEvent(KIND, task), mContent(content)
 {
 }
 
@@ -677,6 +796,11 @@ void CommentEvent::writeEvent(FJson::Writer &out) const
 	Project::writeText(out, mContent);
 }
 
+CommitEvent::CommitEvent(Task *task, std::string commit, const Date &date)
+	:TaskEvent(KIND, task, date), mCommit(commit)
+{
+}
+
 bool CommitEvent::readInternal(FJson::Reader &in, std::string key)
 {
 	if(key == "commit") {
@@ -693,15 +817,22 @@ void CommitEvent::writeEvent(FJson::Writer &out) const
 
 /// Task
 
+static std::atomic<uint64_t> sChangeCount(0);
+
 Task::Task(Project *project, std::string name)
 	:mProject(project), mId(-1), mName(name),
 	mAssigned(User::ANONYMOUS), mType(NULL), mState(NULL),
-	mParent(NULL)
+	mParent(NULL), mDirty(true), mChangeCount(++sChangeCount),
+	mBodyChangeCount(mChangeCount), mBodyOffset(0), mBodyLength(0),
+	mBodyLoaded(false), mBodyListed(false)
 {
 }
 
 Task::~Task()
 {
+	if(mBodyListed) {
+		mProject->releaseBody(this);
+	}
 	for(auto task : mSubTasks) {
 		delete task;
 	}
@@ -716,6 +847,7 @@ void Task::setId(unsigned int id)
 		throw "Id already set";
 	}
 	mId = id;
+	markDirty();
 }
 
 int Task::getId() const
@@ -726,6 +858,7 @@ int Task::getId() const
 void Task::setName(std::string newName)
 {
 	mName = newName;
+	markDirty();
 }
 
 std::string Task::getName() const
@@ -735,17 +868,21 @@ std::string Task::getName() const
 
 void Task::setDescription(std::string text)
 {
+	loadBody();
 	mDesc = text;
+	markDirty(true);
 }
 
 std::string Task::getDescription() const
 {
+	loadBody();
 	return mDesc;
 }
 
 void Task::setAssigned(User *user)
 {
 	mAssigned = user;
+	markDirty();
 }
 
 User *Task::getAssigned() const
@@ -761,6 +898,7 @@ void Task::setType(TaskType *type)
 	}
 	mType = type;
 	mState = type->getStartState();
+	markDirty();
 }
 
 TaskType *Task::getType() const
@@ -773,8 +911,10 @@ bool Task::setState(TaskState *newState)
 	if(!mType->canChange(mState, newState)) {
 		return false;
 	}
-	addEvent(new StateChangeEvent(this, mState, newState));
+	// the state is changed before the event marks the task changed
+	auto *event = new StateChangeEvent(this, mState, newState);
 	mState = newState;
+	addEvent(event);
 	return true;
 }
 
@@ -795,6 +935,7 @@ Task *Task::getParentTask() const
 
 void Task::addSubTask(Task *task)
 {
+	loadBody();
 	if(task->getId() == -1) {
 		task->setId(mSubTasks.size() + 1);
 	} else if((unsigned)task->getId() != mSubTasks.size() + 1) {
@@ -802,88 +943,230 @@ void Task::addSubTask(Task *task)
 	}
 	mSubTasks.push_back(task);
 	task->mParent = this;
+	markDirty(true);
+	if(mProject) {
+		mProject->getTaskList()->invalidateTree();
+	}
 }
 
 const std::vector<Task*> Task::getSubTasks() const
 {
+	loadBody();
 	return mSubTasks;
 }
 
 void Task::addEvent(TaskEvent *event)
 {
-	event->setUser(mProject->getDefaultUser());
+	loadBody();
+	if(event->getUser() == User::ANONYMOUS) {
+		event->setUser(mProject->getDefaultUser());
+	}
 	mEvents.push_back(event);
+	markDirty(true);
 }
 
 const std::vector<TaskEvent*> Task::getEvents() const
 {
+	loadBody();
 	return mEvents;
 }
 
+// Date of the last event or the creation date if there are no events,
+// this doesn't need the body of the task.
+const Date Task::getLastActivity() const
+{
+	if(mBodySource && !mBodyLoaded) {
+		return mLastActivity;
+	}
+	if(!mEvents.empty()) {
+		return mEvents.back()->getCreationDate();
+	}
+	return mCreationDate;
+}
+
 bool Task::isClosed() const
 {
 	return mType->isClosed(mState);
 }
 
+bool Task::isDirty() const
+{
+	return mDirty;
+}
+
+// The published versions share the copy of the task until this changes
+uint64_t Task::getChangeCount() const
+{
+	return mChangeCount;
+}
+
+// The published versions share the description, the events and the
+// sub-tasks until this changes
+uint64_t Task::getBodyChangeCount() const
+{
+	return mBodyChangeCount;
+}
+
+// The sub-tasks are serialized inside their parent so the parents
+// have to be written again too. They are in the body of the parent.
+void Task::markDirty(bool body)
+{
+	for(Task *task = this; task; task = task->mParent) {
+		task->mDirty = true;
+		task->mChangeCount = ++sChangeCount;
+		if(body || task != this) {
+			task->mBodyChangeCount = task->mChangeCount;
+		}
+	}
+	if(mProject) {
+		mProject->getTaskList()->updateTask(this);
+	}
+}
+
+// The published versions have the names of the type and its states,
+// also in the state changes, so the tasks that use the type are copied
+// again. The bodies that aren't loaded have no sub-tasks.
+void Task::touchType(const TaskType *type)
+{
+	if(mType == type) {
+		for(Task *task = this; task; task = task->mParent) {
+			task->mChangeCount = ++sChangeCount;
+			task->mBodyChangeCount = task->mChangeCount;
+		}
+	}
+	for(auto task : mSubTasks) {
+		task->touchType(type);
+	}
+}
+
+void Task::markClean()
+{
+	mDirty = false;
+	for(auto task : mSubTasks) {
+		task->markClean();
+	}
+}
+
 Task *Task::read(Project *project, FJson::Reader &in)
 {
 	auto *task = new Task(project, "");
+	task->readFields(in, METADATA | BODY);
+	return task;
+}
+
+// Reads the selected fields of the task object, the other fields are
+// skipped.
+void Task::readFields(FJson::Reader &in, int fields)
+{
 	int state = -1;
 
 	in.startObject();
 	std::string key;
 	Date creation("2000-01-01T00:00:00Z");
+	bool metadata = fields & METADATA;
+	bool body = fields & BODY;
 
 	while(in.readObjectKey(key)) {
-		if(key == "id") {
-			in.read(task->mId);
-		} else if(key == "name") {
-			in.read(task->mName);
-		} else if(key == "desc") {
-			task->mDesc = Project::readText(in);
-		} else if(key == "type") {
-			std::string type;
-			in.read(type);
-			task->mType = project->getType(type);
-		} else if(key == "state") {
+		if(key == "id" && metadata) {
+			in.read(mId);
+		} else if(key == "name" && metadata) {
+			in.read(mName);
+		} else if(key == "type" && metadata) {
+			mType = mProject->getType(Symbol::read(in));
+		} else if(key == "state" && metadata) {
 			in.read(state);
-		} else if(key == "assigned") {
-			std::string name;
-			in.read(name);
-			task->mAssigned = project->getUser(name);
-		} else if(key == "creation-time") {
+		} else if(key == "assigned" && metadata) {
+			mAssigned = mProject->getUser(Symbol::read(in));
+		} else if(key == "creation-time" && metadata) {
 			std::string time;
 			in.read(time);
 			creation = Date(time);
+		} else if(key == "id" || key == "name" || key == "type" || key == "state"
+			|| key == "assigned" || key == "creation-time") {
+			in.skipValue();
+		} else if(!body) {
+			in.skipValue();
+		} else if(key == "desc") {
+			mDesc = Project::readText(in);
 		} else if(key == "sub-tasks") {
 			in.startArray();
 			while(in.hasNextElement()) {
-				task->addSubTask(Task::read(project, in));
+				addSubTask(Task::read(mProject, in));
 			}
 		} else if(key == "events") {
 			in.startArray();
 			while(in.hasNextElement()) {
-				auto *event = TaskEvent::read(project, in);
-				task->mEvents.push_back(event);
+				auto *event = TaskEvent::read(mProject, in);
+				mEvents.push_back(event);
 			}
 		} else {
-			in.skipValue(&task->mForeignKeys, true);
+			in.skipValue(&mForeignKeys, true);
 		}
 	}
-	if(state != -1) {
-		task->mState = task->mType->getStateById(state);
-	} else {
-		task->mState = task->mType->getStartState();
+	if(metadata) {
+		if(state != -1) {
+			mState = mType->getStateById(state);
+		} else {
+			mState = mType->getStartState();
+		}
+		mCreationDate = creation;
 	}
-	task->mCreationDate = creation;
-	for(auto event : task->mEvents) {
-		event->setTask(task);
+	if(body) {
+		for(auto event : mEvents) {
+			event->setTask(this);
+		}
 	}
-	return task;
+	mDirty = false;
+}
+
+// Parses the body of a lazily read task when it is used the first time
+void Task::loadBody() const
+{
+	if(!mBodySource) {
+		return;
+	}
+	Task *task = const_cast<Task*>(this);
+	if(!mBodyLoaded) {
+		Arena::Scope scope(&mProject->mArena);
+		bool dirty = mDirty;
+		uint64_t changeCount = mChangeCount;
+		uint64_t bodyChangeCount = mBodyChangeCount;
+		task->mBodyLoaded = true;
+		std::istringstream stream(mBodySource->substr(mBodyOffset, mBodyLength));
+		FJson::Reader in(stream);
+		task->readFields(in, BODY);
+		task->mDirty = dirty;
+		task->mChangeCount = changeCount;
+		task->mBodyChangeCount = bodyChangeCount;
+	}
+	mProject->touchBody(task);
+}
+
+// Frees the body, it is parsed again from the last saved version
+void Task::unloadBody()
+{
+	mLastActivity = getLastActivity();
+	for(auto task : mSubTasks) {
+		delete task;
+	}
+	for(auto event : mEvents) {
+		delete event;
+	}
+	mSubTasks.clear();
+	mEvents.clear();
+	mDesc.clear();
+	mForeignKeys = FJson::TokenCache();
+	if(mCache) {
+		mBodySource = mCache;
+		mBodyOffset = 0;
+		mBodyLength = mCache->size();
+	}
+	mBodyLoaded = false;
 }
 
 void Task::write(FJson::Writer &out) const
 {
+	loadBody();
 	out.startObject();
 	out.writeObjectKey("id");
 	out.write(mId);
@@ -921,6 +1204,37 @@ void Task::write(FJson::Writer &out) const
 	out.endObject();
 }
 
+// Returns the serialized task, the task is serialized again only if it
+// has been changed after the previous call. The returned string is never
+// modified so it can be handed to other threads.
+std::shared_ptr<const std::string> Task::serialize(bool *changed)
+{
+	if(mBodySource && !mBodyLoaded && !mDirty) {
+		// the body hasn't been used so the stored task is still valid
+		if(changed) {
+			*changed = false;
+		}
+		if(mBodySource == mCache) {
+			return mCache;
+		}
+		return std::make_shared<const std::string>(mBodySource->substr(mBodyOffset, mBodyLength));
+	}
+	bool refresh = mDirty || !mCache;
+	if(refresh) {
+		std::ostringstream stream;
+		{
+			FJson::Writer fragment(stream, true, 1);//< tasks are in top-level array
+			write(fragment);
+		}
+		mCache = std::make_shared<const std::string>(stream.str());
+		markClean();
+	}
+	if(changed) {
+		*changed = refresh;
+	}
+	return mCache;
+}
+
 /// TaskFilter
 
 TaskFilter::TaskFilter(FilterType type)
@@ -1011,7 +1325,7 @@ bool TaskFilter::getValue(const Task *task)
 		case IS_OPEN:
 			return mIsOpen == !task->isClosed();
 		case HAS_STATE:
-			return task->getState()->getName() == mState;
+			return task->getState()->getSymbol() == mState;
 		case SEARCH:
 			if(lower(task->getName()).find(mQuery) != std::string::npos) {
 				return true;
@@ -1024,6 +1338,55 @@ bool TaskFilter::getValue(const Task *task)
 	return true;
 }
 
+// Evaluates the filter for every row of the columns at once, only the
+// search looks at the tasks
+void TaskFilter::select(const TaskColumns &columns, std::vector<uint8_t> &mask)
+{
+	size_t size = columns.task.size();
+	mask.resize(size);
+	switch(mType) {
+		case NOT_OF:
+			mFirst->select(columns, mask);
+			for(size_t i = 0; i < size; i++) {
+				mask[i] = !mask[i];
+			}
+			break;
+		case OR_OF:
+		case AND_OF: {
+			std::vector<uint8_t> second;
+			mFirst->select(columns, mask);
+			mSecond->select(columns, second);
+			if(mType == OR_OF) {
+				for(size_t i = 0; i < size; i++) {
+					mask[i] |= second[i];
+				}
+			} else {
+				for(size_t i = 0; i < size; i++) {
+					mask[i] &= second[i];
+				}
+			}
+			break;
+		}
+		case IS_OPEN: {
+			uint8_t open = mIsOpen;
+			for(size_t i = 0; i < size; i++) {
+				mask[i] = columns.open[i] == open;
+			}
+			break;
+		}
+		case HAS_STATE:
+			for(size_t i = 0; i < size; i++) {
+				mask[i] = columns.state[i] == mState;
+			}
+			break;
+		case SEARCH:
+			for(size_t i = 0; i < size; i++) {
+				mask[i] = getValue(columns.task[i]);
+			}
+			break;
+	}
+}
+
 std::string TaskFilter::lower(std::string str)
 {
 	std::string copy = str;
@@ -1292,6 +1655,11 @@ TaskFilter *Search::doQuery()
 
 /// TaskList
 
+TaskList::TaskList()
+	:mTreeValid(false), mDirty(true), mRemoved(false), mTombstones(0), mNextId(1)
+{
+}
+
 TaskList::~TaskList()
 {
 	for(auto task : mTasks) {
@@ -1302,143 +1670,1217 @@ TaskList::~TaskList()
 void TaskList::addTask(Task *task)
 {
 	if(task->getId() == -1) {
-		task->setId(mTasks.size() + 1);
+		task->setId(mNextId);
+	}
+	unsigned int id = task->getId();
+	if(!mSlots.emplace(id, mTasks.size()).second) {
+		throw "Task id is already used";
 	}
 	mTasks.push_back(task);
+	mNextId = std::max(mNextId, id + 1);
+	mDirty = true;
+	mTreeValid = false;
 }
 
+// The task is left in a tombstone, the tombstones are removed when they
+// are the most of the list
 void TaskList::removeTask(Task *task)
 {
-	mTasks.erase(std::remove(mTasks.begin(), mTasks.end(), task),
-		mTasks.end());
+	auto slot = mSlots.find(task->getId());
+	if(slot == mSlots.end() || mTasks[slot->second] != task) {
+		return;
+	}
+	mTasks[slot->second] = NULL;
+	mSlots.erase(slot);
+	mTombstones++;
+	if(mTombstones > 32 && mTombstones > mTasks.size() / 2) {
+		compact();
+	}
+	mDirty = true;
+	mRemoved = true;
+	mTreeValid = false;
+}
+
+void TaskList::compact()
+{
+	mTasks.erase(std::remove(mTasks.begin(), mTasks.end(), (Task*)NULL), mTasks.end());
+	for(size_t i = 0; i < mTasks.size(); i++) {
+		mSlots[mTasks[i]->getId()] = i;
+	}
+	mTombstones = 0;
 }
 
-Task *TaskList::getTask(unsigned int id)
+// Replaces the task that has the same id or adds the task
+void TaskList::setTask(Task *task)
 {
-	id--;
-	if(id >= mTasks.size()) {
-		return NULL;
+	auto slot = mSlots.find(task->getId());
+	if(slot != mSlots.end()) {
+		delete mTasks[slot->second];
+		mTasks[slot->second] = task;
+		mDirty = true;
+		mTreeValid = false;
+	} else {
+		addTask(task);
 	}
-	return mTasks[id];
+}
+
+Task *TaskList::getTask(unsigned int id)
+{
+	auto slot = mSlots.find(id);
+	return slot != mSlots.end() ? mTasks[slot->second] : NULL;
 }
 
 const std::vector<Task*> TaskList::all() const
 {
-	return mTasks;
+	std::vector<Task*> tasks;
+	tasks.reserve(mSlots.size());
+	for(auto task : mTasks) {
+		if(task) {
+			tasks.push_back(task);
+		}
+	}
+	return tasks;
 }
 
-const std::vector<Task*> TaskList::getFiltered(TaskFilter *filter) const
+// Filters the top level tasks over the task columns
+const std::vector<Task*> TaskList::getFiltered(TaskFilter *filter)
 {
-	std::vector<Task*> newList(std::min((int)mTasks.size(), 256));
-	auto it = std::copy_if(mTasks.begin(), mTasks.end(), newList.begin(), filter->wrap());
-	newList.resize(std::distance(newList.begin(), it));
+	const TaskTree &tree = getTree();
+	std::vector<uint8_t> mask;
+	filter->select(tree.getColumns(), mask);
+	std::vector<Task*> newList;
+	const auto &nodes = tree.getNodes();
+	for(size_t i = 0; i < nodes.size(); i++) {
+		if(mask[i] && nodes[i].parent == -1) {
+			newList.push_back(nodes[i].task);
+		}
+	}
 	return newList;
 }
 
 unsigned int TaskList::getSize() const
 {
-	return mTasks.size();
+	return mSlots.size();
 }
 
-/// Project
-
-Project *Project::create(std::string dirname)
+bool TaskList::isDirty() const
 {
-	auto project = new Project();
-	project->mDirname = dirname;
-	project->mTaskStorage = GitBackend::create(dirname);
-	return project;
+	return mDirty;
 }
 
-Project *Project::open(std::string dirname)
+bool TaskList::hasRemovals() const
 {
-	auto project = new Project();
-	project->mDirname = dirname;
-	project->mTaskStorage = GitBackend::open(dirname);
-	if(!project->mTaskStorage) {
-		//TODO throw some excpetion
-		return NULL;
-	}
-	std::string source = Config::getSourceDir(dirname);
-	if(!source.empty()) {
-		project->mSrcStorage = GitBackend::open(source);
-	}
-	if(project->read()) {
-		return project;
-	} else {
-		delete project;
-		return NULL;
-	}
+	return mRemoved;
 }
 
-Project::Project()
-	:mDefaultUser(NULL), mSrcStorage(NULL), mTaskStorage(NULL)
+void TaskList::markClean()
 {
+	mDirty = false;
+	mRemoved = false;
 }
 
-Project::~Project()
+void TaskList::clear()
 {
-	if(mSrcStorage) delete mSrcStorage;
-	if(mTaskStorage) delete mTaskStorage;
-
-	for(const auto &entry : mTypes) {
-		delete entry.second;
-	}
-
-	for(const auto &user : mUsers) {
-		delete user.second;
+	for(auto task : mTasks) {
+		delete task;
 	}
+	mTasks.clear();
+	mSlots.clear();
+	mTombstones = 0;
+	mNextId = 1;
+	mDirty = false;
+	mTreeValid = false;
 }
 
-TaskType *Project::getType(std::string name)
+unsigned int TaskList::getNextId() const
 {
-	auto iter = mTypes.find(name);
-	return (iter != mTypes.end()) ? iter->second : NULL;
+	return mNextId;
 }
 
-User *Project::getDefaultUser()
+// The stored next id is used if it is greater than the ids of the tasks
+void TaskList::setNextId(unsigned int id)
 {
-	if(!mDefaultUser) {
-		return Config::getDefaultUser();
-	}
-	return mDefaultUser;
+	mNextId = std::max(mNextId, id);
 }
 
-User *Project::getUser(std::string name)
+// The tree is built again when it is used after the tasks or the
+// sub-tasks have changed
+const TaskTree &TaskList::getTree()
 {
-	auto iter = mUsers.find(name);
-	if(iter != mUsers.end()) {
-		return iter->second;
-	} else {
-		User *user = new User(name);
-		mUsers[name] = user;
-		return user;
+	if(!mTreeValid) {
+		mTree.build(all());
+		mTreeValid = true;
 	}
+	return mTree;
 }
 
-TaskList *Project::getTaskList()
+Task *TaskList::findTask(const std::string &path)
 {
-	return &mList;
+	auto *node = getTree().find(path);
+	return node ? node->task : NULL;
 }
 
-void Project::write()
+void TaskList::invalidateTree()
 {
-	writeMain();
-	writeTasks();
-
-	if(mTaskStorage) {
-		mTaskStorage->commit();
-	}
+	mTreeValid = false;
 }
 
-std::streambuf *Project::getOutStream(std::string path)
+// Updates the columns of a changed task, nothing is done if the tree is
+// built again anyway
+void TaskList::updateTask(Task *task)
 {
-	if(!mTaskStorage) {
-		std::filebuf *buf = new std::filebuf;
-		buf->open(mDirname + "/" + path, std::ios_base::binary | std::ios_base::out | std::ios_base::trunc);
-		return buf;
-	} else {
-		return mTaskStorage->addFile(path);
+	if(mTreeValid) {
+		mTree.update(task);
+	}
+}
+
+/// TaskColumns
+
+void TaskColumns::resize(size_t rows)
+{
+	task.resize(rows);
+	state.resize(rows);
+	type.resize(rows);
+	assigned.resize(rows);
+	open.resize(rows);
+	created.resize(rows);
+	activity.resize(rows);
+}
+
+void TaskColumns::set(size_t row, Task *task)
+{
+	this->task[row] = task;
+	state[row] = task->mState ? task->mState->getSymbol() : Symbol();
+	type[row] = task->mType;
+	assigned[row] = task->mAssigned;
+	open[row] = !task->mType || !task->mType->isClosed(task->mState);
+	created[row] = task->mCreationDate.getTimestamp();
+	activity[row] = task->getLastActivity().getTimestamp();
+}
+
+/// TaskTree
+
+void TaskTree::build(const std::vector<Task*> &tasks)
+{
+	mNodes.clear();
+	mPaths.clear();
+	mIndex.clear();
+	for(auto task : tasks) {
+		add(task, std::to_string(task->getId()), -1);
+	}
+	mColumns.resize(mNodes.size());
+	for(size_t i = 0; i < mNodes.size(); i++) {
+		mColumns.set(i, mNodes[i].task);
+	}
+}
+
+void TaskTree::update(Task *task)
+{
+	auto node = mIndex.find(task);
+	if(node != mIndex.end()) {
+		mColumns.set(node->second, task);
+	}
+}
+
+const TaskColumns &TaskTree::getColumns() const
+{
+	return mColumns;
+}
+
+void TaskTree::add(Task *task, const std::string &path, int parent)
+{
+	unsigned int index = mNodes.size();
+	mNodes.push_back({task, path, parent, 0});
+	mPaths[path] = index;
+	mIndex[task] = index;
+	for(auto subTask : task->mSubTasks) {
+		add(subTask, path + "." + std::to_string(subTask->getId()), index);
+	}
+	mNodes[index].end = mNodes.size();
+}
+
+const std::vector<TaskTree::Node> &TaskTree::getNodes() const
+{
+	return mNodes;
+}
+
+// The path may start with #
+const TaskTree::Node *TaskTree::find(const std::string &path) const
+{
+	auto node = mPaths.find(!path.empty() && path[0] == '#' ? path.substr(1) : path);
+	return node != mPaths.end() ? &mNodes[node->second] : NULL;
+}
+
+std::string TaskTree::getPath(const Task *task) const
+{
+	auto node = mIndex.find(task);
+	return node != mIndex.end() ? mNodes[node->second].path : "";
+}
+
+std::vector<const TaskTree::Node*> TaskTree::getFiltered(TaskFilter *filter) const
+{
+	std::vector<uint8_t> mask;
+	filter->select(mColumns, mask);
+	std::vector<const Node*> nodes;
+	for(size_t i = 0; i < mNodes.size(); i++) {
+		if(mask[i]) {
+			nodes.push_back(&mNodes[i]);
+		}
+	}
+	return nodes;
+}
+
+// Most recently active first
+void TaskTree::sortByActivity(std::vector<const Node*> &nodes) const
+{
+	const Node *first = mNodes.data();
+	const int64_t *activity = mColumns.activity.data();
+	std::sort(nodes.begin(), nodes.end(), [first, activity](const Node *a, const Node *b) {
+		return activity[a - first] > activity[b - first];
+	});
+}
+
+/// AtomicFileBuffer
+
+// Files that are larger than the direct threshold are preallocated and
+// written with O_DIRECT so that they don't flush the page cache.
+AtomicFileBuffer::AtomicFileBuffer(std::string path, size_t sizeHint)
+	:mPath(path), mTemp(path + ".tmp"), mFd(-1), mDirect(false),
+	mFailed(false), mBuffer(NULL), mWritten(0)
+{
+	bool large = sizeHint >= DIRECT_THRESHOLD;
+	if(large) {
+		// not every file system supports O_DIRECT
+		mFd = open(mTemp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+		mDirect = mFd >= 0;
+	}
+	if(mFd < 0) {
+		mFd = open(mTemp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if(mFd >= 0 && large) {
+		posix_fallocate(mFd, 0, sizeHint);
+	}
+	void *buffer;
+	if(mFd < 0 || posix_memalign(&buffer, 4096, BUFFER_SIZE)) {
+		mFailed = true;
+		return;
+	}
+	mBuffer = (char*)buffer;
+	setp(mBuffer, mBuffer + BUFFER_SIZE);
+}
+
+AtomicFileBuffer::~AtomicFileBuffer()
+{
+	if(mFd >= 0) {
+		close(mFd);
+		unlink(mTemp.c_str());
+	}
+	free(mBuffer);
+}
+
+int AtomicFileBuffer::overflow(int c)
+{
+	if(!writeBuffer()) {
+		return traits_type::eof();
+	}
+	if(c != traits_type::eof()) {
+		*pptr() = c;
+		pbump(1);
+	}
+	return traits_type::not_eof(c);
+}
+
+int AtomicFileBuffer::sync()
+{
+	return writeBuffer() ? 0 : -1;
+}
+
+bool AtomicFileBuffer::writeBuffer()
+{
+	if(mFailed) {
+		return false;
+	}
+	size_t length = pptr() - pbase();
+	if(mDirect && length % 4096) {
+		// only the end of the file isn't aligned
+		fcntl(mFd, F_SETFL, fcntl(mFd, F_GETFL) & ~O_DIRECT);
+		mDirect = false;
+	}
+	for(size_t done = 0; done < length;) {
+		ssize_t count = write(mFd, pbase() + done, length - done);
+		if(count < 0 && errno == EINTR) {
+			continue;
+		} else if(count <= 0) {
+			mFailed = true;
+			return false;
+		}
+		done += count;
+	}
+	mWritten += length;
+	setp(mBuffer, mBuffer + BUFFER_SIZE);
+	return true;
+}
+
+// Makes the written data durable and replaces the file with it
+void AtomicFileBuffer::commit()
+{
+	bool done = writeBuffer();
+	// the preallocated space may be larger than the data
+	done = done && ftruncate(mFd, mWritten) == 0;
+	done = done && fsync(mFd) == 0;
+	done &= close(mFd) == 0;
+	mFd = -1;
+	done = done && rename(mTemp.c_str(), mPath.c_str()) == 0;
+	if(!done) {
+		unlink(mTemp.c_str());
+		throw "Couldn't write the file";
+	}
+
+	// the rename is durable when the directory is synced
+	size_t slash = mPath.rfind('/');
+	std::string dir = slash == std::string::npos ? "." : mPath.substr(0, slash + 1);
+	int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if(dirFd >= 0) {
+		fsync(dirFd);
+		close(dirFd);
+	}
+}
+
+/// SaveQueue
+
+// Stores the project snapshots in background thread so that the saving
+// doesn't block the user interface. The snapshots that are pushed within
+// the commit window are merged to a single commit.
+class SaveQueue
+{
+public:
+	SaveQueue(Project *project);
+	~SaveQueue();
+	void setGroupCommit(unsigned int windowMs, unsigned int maxPending);
+	std::future<void> push(const Project::SaveSnapshot &snapshot, bool detached = false);
+	void flush();
+	std::exception_ptr takeError();
+private:
+	struct Job {
+		Project::SaveSnapshot snapshot;
+		std::promise<void> done;
+		std::chrono::steady_clock::time_point created;
+		bool detached;//< nobody waits for the future
+	};
+	void run();
+	static void merge(Project::SaveSnapshot &into, const Project::SaveSnapshot &from);
+
+	Project *mProject;
+	std::deque<Job*> mJobs;
+	std::chrono::milliseconds mWindow;
+	unsigned int mMaxPending;
+	unsigned int mFlushing;
+	bool mBusy;
+	bool mQuit;
+	std::exception_ptr mError;
+	std::mutex mMutex;
+	std::condition_variable mChanged;
+	std::condition_variable mIdle;
+	std::thread mThread;
+};
+
+SaveQueue::SaveQueue(Project *project)
+	:mProject(project), mWindow(0), mMaxPending(0), mFlushing(0),
+	mBusy(false), mQuit(false)
+{
+	mThread = std::thread(&SaveQueue::run, this);
+}
+
+SaveQueue::~SaveQueue()
+{
+	flush();
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+	mChanged.notify_all();
+	mThread.join();
+
+	// nobody can take the error of a detached save any more
+	std::exception_ptr error = takeError();
+	if(error) {
+		try {
+			std::rethrow_exception(error);
+		} catch(const char *e) {
+			std::cerr << "Saving the project failed: " << e << "\n";
+		} catch(const std::exception &e) {
+			std::cerr << "Saving the project failed: " << e.what() << "\n";
+		} catch(...) {
+			std::cerr << "Saving the project failed\n";
+		}
+	}
+}
+
+// The pending saves are committed when the oldest of them is older than
+// the window or when there are max pending saves. Zero max pending means
+// that there is no limit and zero window means that the saves wait only
+// for the max pending saves or flush.
+void SaveQueue::setGroupCommit(unsigned int windowMs, unsigned int maxPending)
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mWindow = std::chrono::milliseconds(windowMs);
+		mMaxPending = maxPending;
+	}
+	mChanged.notify_all();
+}
+
+std::future<void> SaveQueue::push(const Project::SaveSnapshot &snapshot, bool detached)
+{
+	Job *job = new Job;
+	job->snapshot = snapshot;
+	job->created = std::chrono::steady_clock::now();
+	job->detached = detached;
+	std::future<void> future = job->done.get_future();
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mJobs.push_back(job);
+	}
+	mChanged.notify_all();
+	return future;
+}
+
+// Commits the pending saves immediately and waits until they are done.
+void SaveQueue::flush()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	mFlushing++;
+	mChanged.notify_all();
+	mIdle.wait(lock, [this] {return mJobs.empty() && !mBusy;});
+	mFlushing--;
+}
+
+// Returns the error of the failed detached save
+std::exception_ptr SaveQueue::takeError()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	std::exception_ptr error = mError;
+	mError = nullptr;
+	return error;
+}
+
+void SaveQueue::merge(Project::SaveSnapshot &into, const Project::SaveSnapshot &from)
+{
+	for(const auto &file : from) {
+		auto iter = std::find_if(into.begin(), into.end(),
+			[&file](const Project::FileSnapshot &other) {
+				return other.path == file.path;
+			});
+		if(iter != into.end()) {
+			*iter = file;
+		} else {
+			into.push_back(file);
+		}
+	}
+}
+
+void SaveQueue::run()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	while(true) {
+		mChanged.wait(lock, [this] {return mQuit || !mJobs.empty();});
+		if(mJobs.empty()) {
+			break;
+		}
+		auto ready = [this] {
+			return mQuit || mFlushing ||
+				(mMaxPending && mJobs.size() >= mMaxPending);
+		};
+		if(mWindow.count() || !mMaxPending) {
+			mChanged.wait_until(lock, mJobs.front()->created + mWindow, ready);
+		} else {
+			mChanged.wait(lock, ready);
+		}
+
+		std::deque<Job*> jobs;
+		jobs.swap(mJobs);
+		mBusy = true;
+		lock.unlock();
+
+		Project::SaveSnapshot snapshot;
+		for(auto job : jobs) {
+			merge(snapshot, job->snapshot);
+		}
+		std::exception_ptr error;
+		try {
+			mProject->store(snapshot);
+		} catch(...) {
+			mProject->mStoreFailed = true;
+			error = std::current_exception();
+		}
+
+		lock.lock();
+		for(auto job : jobs) {
+			if(!error) {
+				job->done.set_value();
+			} else {
+				job->done.set_exception(error);
+				if(job->detached) {
+					mError = error;
+				}
+			}
+			delete job;
+		}
+		mBusy = false;
+		mIdle.notify_all();
+	}
+}
+
+/// Project
+
+Project *Project::create(std::string dirname)
+{
+	auto project = new Project();
+	project->mDirname = dirname;
+	project->mTaskStorage = GitBackend::create(dirname);
+	return project;
+}
+
+// Creates a project that is stored only in memory
+Project *Project::createInMemory()
+{
+	auto project = new Project();
+	project->mTaskStorage = GitBackend::createInMemory();
+	return project;
+}
+
+// Creates a project from the tasks pushed to the url
+Project *Project::clone(std::string url, std::string dirname)
+{
+	auto project = new Project();
+	project->mDirname = dirname;
+	project->mTaskStorage = GitBackend::clone(url, dirname);
+	if(project->read()) {
+		return project;
+	}
+	delete project;
+	return NULL;
+}
+
+// When the body budget is set only the metadata of the tasks is read and
+// the rest of the task is read when it is used. The least recently used
+// bodies are freed when they take more than the budget. The tasks that
+// have sub-tasks are always read fully.
+Project *Project::open(std::string dirname, size_t bodyBudget)
+{
+	auto project = new Project();
+	project->mDirname = dirname;
+	project->mBodyBudget = bodyBudget;
+	project->mTaskStorage = GitBackend::open(dirname);
+	if(!project->mTaskStorage) {
+		//TODO throw some excpetion
+		return NULL;
+	}
+	std::string source = Config::getSourceDir(dirname);
+	if(!source.empty()) {
+		project->mSrcStorage = GitBackend::open(source);
+	}
+	if(project->read()) {
+		project->indexCommits();
+		return project;
+	} else {
+		delete project;
+		return NULL;
+	}
+}
+
+// Opens a read only snapshot of the project as it was in the revision
+Project *Project::openAt(std::string dirname, std::string revision)
+{
+	auto project = new Project();
+	project->mDirname = dirname;
+	project->mTaskStorage = GitBackend::open(dirname);
+	if(project->mTaskStorage) {
+		project->mRevision = project->mTaskStorage->getCommit(revision);
+	}
+	if(!project->mRevision.empty() && project->read()) {
+		return project;
+	}
+	delete project;
+	return NULL;
+}
+
+Project *Project::openAt(std::string dirname, const Date &date)
+{
+	GitBackend *storage = GitBackend::open(dirname);
+	if(!storage) {
+		return NULL;
+	}
+	std::string commit = storage->findCommit(date.getTimestamp());
+	delete storage;
+	if(commit.empty()) {
+		return NULL;
+	}
+	return openAt(dirname, commit);
+}
+
+Project::Project()
+	:mDefaultUser(NULL), mDirty(true), mSaveStats(), mSaveQueue(NULL),
+	mStoreFailed(false), mGroupWindow(0), mGroupMaxPending(0),
+	mSrcStorage(NULL), mTaskStorage(NULL), mHistory(NULL),
+	mBodyBudget(0), mBodyMemory(0), mJournal(NULL), mJournalLimit(0),
+	mCompactedSeq(0), mVersion(std::make_shared<ProjectVersion>())
+{
+}
+
+Project::~Project()
+{
+	clearBodies();
+	delete mSaveQueue;
+	delete mJournal;
+	delete mHistory;
+	if(mSrcStorage) delete mSrcStorage;
+	if(mTaskStorage) delete mTaskStorage;
+
+	for(const auto &entry : mTypes) {
+		delete entry.second;
+	}
+
+	for(const auto &user : mUsers) {
+		delete user.second;
+	}
+}
+
+TaskType *Project::getType(Symbol name)
+{
+	auto iter = mTypes.find(name);
+	return (iter != mTypes.end()) ? iter->second : NULL;
+}
+
+User *Project::getDefaultUser()
+{
+	if(!mDefaultUser) {
+		return Config::getDefaultUser();
+	}
+	return mDefaultUser;
+}
+
+User *Project::getUser(Symbol name)
+{
+	auto iter = mUsers.find(name);
+	if(iter != mUsers.end()) {
+		return iter->second;
+	} else {
+		User *user = new User(name);
+		mUsers[name] = user;
+		return user;
+	}
+}
+
+TaskList *Project::getTaskList()
+{
+	return &mList;
+}
+
+// When group commit is enabled the changes are only queued and they are
+// guaranteed to be committed after flush(). With the journal the changed
+// tasks are only appended to the journal.
+void Project::write()
+{
+	if(mJournalLimit) {
+		writeJournal();
+		return;
+	}
+	if(mGroupWindow || mGroupMaxPending) {
+		getSaveQueue()->push(snapshot(), true);
+		return;
+	}
+	flush();
+	store(snapshot());
+}
+
+// Takes snapshot of the changed data and stores it in background. The
+// returned future is ready when the data is committed.
+std::future<void> Project::writeAsync()
+{
+	return getSaveQueue()->push(snapshot());
+}
+
+// Commits and waits all the background saves. Throws the error if some
+// of the queued writes failed.
+void Project::flush()
+{
+	if(!mSaveQueue) {
+		return;
+	}
+	mSaveQueue->flush();
+	std::exception_ptr error = mSaveQueue->takeError();
+	if(error) {
+		std::rethrow_exception(error);
+	}
+}
+
+// Packs the loose objects of the task repository after the pending
+// writes are stored.
+MaintenanceReport Project::maintain()
+{
+	flush();
+	if(!mTaskStorage) {
+		return MaintenanceReport();
+	}
+	return mTaskStorage->maintain();
+}
+
+std::string Project::getDirname() const
+{
+	return mDirname;
+}
+
+// Lists the stored changes of the task, the pending writes are stored
+// first.
+std::vector<TaskChange> Project::getTaskHistory(unsigned int id)
+{
+	if(!mTaskStorage || mTaskFile.empty()) {
+		return std::vector<TaskChange>();
+	}
+	flush();
+	if(!mHistory) {
+		mHistory = new TaskHistory(mTaskStorage, mTaskFile);
+	}
+	return mHistory->getChanges(id);
+}
+
+// Compares the tasks of the two revisions
+std::vector<TaskDiff> Project::diff(std::string from, std::string to)
+{
+	if(!mTaskStorage || mTaskFile.empty()) {
+		return std::vector<TaskDiff>();
+	}
+	flush();
+	std::string fromCommit = mTaskStorage->getCommit(from);
+	std::string toCommit = mTaskStorage->getCommit(to);
+	if(fromCommit.empty() || toCommit.empty()) {
+		throw "Unknown revision";
+	}
+	if(!mHistory) {
+		mHistory = new TaskHistory(mTaskStorage, mTaskFile);
+	}
+	return mHistory->diff(fromCommit, toCommit);
+}
+
+// Uses the repository as the source code of the project
+bool Project::setSource(std::string path)
+{
+	GitBackend *storage = GitBackend::open(path);
+	if(!storage) {
+		return false;
+	}
+	delete mSrcStorage;
+	mSrcStorage = storage;
+	return true;
+}
+
+// Finds the task ids referenced as #id in the text
+static std::set<unsigned int> findTaskReferences(const std::string &text)
+{
+	std::set<unsigned int> ids;
+	size_t pos = 0;
+	while((pos = text.find('#', pos)) != std::string::npos) {
+		size_t end = ++pos;
+		while(end < text.size() && isdigit((unsigned char)text[end])) {
+			end++;
+		}
+		bool isWord = end < text.size() && isalpha((unsigned char)text[end]);
+		if(end > pos && !isWord) {
+			ids.insert(strtoul(text.c_str() + pos, NULL, 10));
+		}
+		pos = end;
+	}
+	return ids;
+}
+
+// Adds a commit event to the tasks referenced in the source commits made
+// after the previous indexing. Returns the number of added events.
+unsigned int Project::indexCommits()
+{
+	if(!mSrcStorage) {
+		return 0;
+	}
+	std::string head;
+	auto commits = mSrcStorage->getNewCommits(mIndexedCommit, &head);
+
+	unsigned int count = 0;
+	for(const auto &commit : commits) {
+		for(unsigned int id : findTaskReferences(commit.message)) {
+			Task *task = mList.getTask(id);
+			if(!task) continue;
+
+			bool known = false;
+			for(auto *event : task->getEvents()) {
+				auto *commitEvent = event->as<CommitEvent>();
+				known |= commitEvent && commitEvent->getCommit() == commit.id;
+			}
+			if(known) continue;
+
+			auto *event = new CommitEvent(task, commit.id, Date(commit.time));
+			event->setUser(getUser(commit.author));
+			task->addEvent(event);
+			count++;
+		}
+	}
+	if(!head.empty() && head != mIndexedCommit) {
+		mIndexedCommit = head;
+		mDirty = true;
+	}
+	return count;
+}
+
+// Fetches the task repository from the url and merges it with the local
+// changes. The tasks changed only on one side are taken as is and the
+// tasks changed on both sides are merged field by field.
+Project::MergeStats Project::pull(std::string url)
+{
+	MergeStats stats = MergeStats();
+	if(!mTaskStorage) {
+		return stats;
+	}
+	commitAll();
+
+	std::string theirs = mTaskStorage->fetch(url);
+	if(theirs.empty()) {
+		return stats;
+	}
+	std::string ours = mTaskStorage->getCommit("HEAD");
+	std::string base = mTaskStorage->getMergeBase(ours, theirs);
+	if(base == theirs) {
+		return stats;
+	}
+	std::string ourConfig = readRevision("tasker.conf", ours);
+	std::string theirConfig = readRevision("tasker.conf", theirs);
+	if(base == ours || mTaskFile.empty()) {
+		mTaskStorage->setHead(theirs);
+		std::shared_ptr<const std::string> tasks;
+		if(!mTaskFile.empty() && mTaskStorage->getFileId(mTaskFile, ours) != mTaskStorage->getFileId(mTaskFile, theirs)) {
+			tasks = std::make_shared<const std::string>(readRevision(mTaskFile, theirs));
+		}
+		if(mTaskFile.empty() || !applyMerge(ourConfig, theirConfig, tasks, stats)) {
+			reload();
+		}
+		return stats;
+	}
+	unsigned int nextId = std::max(TaskMerge::getNextId(ourConfig), TaskMerge::getNextId(theirConfig));
+
+	// The task file is a single blob so the whole files are scanned and
+	// the merged file is written whole, only the changed tasks are parsed.
+	std::shared_ptr<const std::string> tasks;
+	std::string baseId = base.empty() ? "" : mTaskStorage->getFileId(mTaskFile, base);
+	std::string ourId = mTaskStorage->getFileId(mTaskFile, ours);
+	std::string theirId = mTaskStorage->getFileId(mTaskFile, theirs);
+	if(theirId != baseId && theirId != ourId && ourId == baseId) {
+		tasks = std::make_shared<const std::string>(readRevision(mTaskFile, theirs));
+	} else if(theirId != baseId && theirId != ourId) {
+		auto baseIndex = TaskIndex::scan(std::make_shared<const std::string>(
+			base.empty() ? "[]" : readRevision(mTaskFile, base)));
+		auto ourIndex = TaskIndex::scan(std::make_shared<const std::string>(readRevision(mTaskFile, ours)));
+		auto theirIndex = TaskIndex::scan(std::make_shared<const std::string>(readRevision(mTaskFile, theirs)));
+		tasks = std::make_shared<const std::string>(
+			TaskMerge::merge(*baseIndex, *ourIndex, *theirIndex, nextId, stats));
+	}
+
+	std::string config = ourConfig;
+	baseId = base.empty() ? "" : mTaskStorage->getFileId("tasker.conf", base);
+	ourId = mTaskStorage->getFileId("tasker.conf", ours);
+	theirId = mTaskStorage->getFileId("tasker.conf", theirs);
+	if(theirId != baseId && theirId != ourId && ourId == baseId) {
+		config = theirConfig;
+	} else if(theirId != baseId && theirId != ourId) {
+		config = TaskMerge::mergeConfig(baseId.empty() ? "{}" : readRevision("tasker.conf", base),
+			ourConfig, theirConfig, nextId, stats);
+	}
+	if(TaskMerge::getNextId(config) < nextId) {
+		// the ids given to their tasks must not be given again
+		config = TaskMerge::mergeConfig(config, config, config, nextId, stats);
+	}
+
+	std::vector<std::pair<std::string, const std::string*> > files;
+	if(config != ourConfig) {
+		files.push_back(std::make_pair("tasker.conf", &config));
+	}
+	if(tasks) {
+		files.push_back(std::make_pair(mTaskFile, tasks.get()));
+	}
+	for(const auto &file : files) {
+		std::streambuf *buf = mTaskStorage->addFile(file.first);
+		{
+			std::ostream stream(buf);
+			stream << *file.second;
+		}
+		delete buf;
+	}
+
+	// the merge is recorded even if it takes nothing from them so that
+	// the same changes aren't merged again
+	mTaskStorage->commit("", theirs);
+	if(!applyMerge(ourConfig, config, tasks, stats)) {
+		reload();
+	}
+	return stats;
+}
+
+// Applies the merged files to the project without reading it again. Only
+// the tasks that differ from the live ones are parsed from the merged
+// task file. The types are shared by the tasks so a type changed by them
+// isn't applied, false is returned and the project has to be read again.
+bool Project::applyMerge(const std::string &ourConfig, const std::string &config,
+	std::shared_ptr<const std::string> tasks, MergeStats &stats)
+{
+	Arena::Scope scope(&mArena);
+	if(config != ourConfig) {
+		auto fields = TaskIndex::scanFields(config);
+		auto types = TaskIndex::scanFieldList(fields["types"]);
+		auto ourTypes = TaskIndex::scanFields(TaskIndex::scanFields(ourConfig)["types"]);
+		std::map<std::string, std::string> typeValues(types.begin(), types.end());
+		for(const auto &type : ourTypes) {
+			auto merged = typeValues.find(type.first);
+			if(merged == typeValues.end() || merged->second != type.second) {
+				return false;
+			}
+		}
+		for(const auto &type : types) {
+			if(ourTypes.count(type.first)) {
+				continue;
+			}
+			std::istringstream stream(type.second);
+			FJson::Reader in(stream);
+			auto *added = TaskType::read(this, in);
+			added->markClean();
+			mTypes[type.first] = added;
+		}
+		if(fields.count("indexed-commit")) {
+			std::istringstream stream(fields["indexed-commit"]);
+			FJson::Reader in(stream);
+			in.read(mIndexedCommit);
+		}
+		mList.setNextId(TaskMerge::getNextId(config));
+	}
+
+	if(tasks) {
+		auto index = TaskIndex::scan(tasks);
+		for(const auto &entry : index->getTasks()) {
+			Task *live = mList.getTask(entry.first);
+			if(live && tasks->compare(entry.second.offset, entry.second.length, *live->serialize()) == 0) {
+				continue;
+			}
+			Task *task;
+			if(mBodyBudget) {
+				task = readLazyTask(tasks, entry.second.offset, entry.second.length);
+			} else {
+				auto element = std::make_shared<const std::string>(index->getTask(entry.second));
+				std::istringstream stream(*element);
+				FJson::Reader in(stream);
+				task = Task::read(this, in);
+				task->mCache = element;
+			}
+			mList.setTask(task);
+			stats.tasksRead++;
+		}
+		for(auto task : mList.all()) {
+			if(!index->find(task->getId())) {
+				mList.removeTask(task);
+				delete task;
+			}
+		}
+	}
+	mList.markClean();
+	return true;
+}
+
+// Changes the memory budget of the lazily read task bodies
+void Project::setBodyBudget(size_t bytes)
+{
+	mBodyBudget = bytes;
+	if(!mLoadedBodies.empty()) {
+		touchBody(mLoadedBodies.front());
+	}
+}
+
+// Marks the body as the most recently used one and frees the oldest
+// bodies that are over the budget. The changed tasks are kept until
+// they are written. The task tree points to the sub-tasks so the bodies
+// that have sub-tasks are read with the metadata and they are never
+// freed, they are kept outside of the budget.
+void Project::touchBody(Task *task)
+{
+	if(!task->mSubTasks.empty()) {
+		if(task->mBodyListed) {
+			releaseBody(task);
+		}
+		return;
+	}
+	if(task->mBodyListed) {
+		mLoadedBodies.splice(mLoadedBodies.begin(), mLoadedBodies, task->mBodyEntry);
+	} else {
+		mLoadedBodies.push_front(task);
+		task->mBodyEntry = mLoadedBodies.begin();
+		task->mBodyListed = true;
+		mBodyMemory += task->mBodyLength;
+	}
+
+	auto iter = mLoadedBodies.end();
+	while(mBodyMemory > mBodyBudget && iter != mLoadedBodies.begin()) {
+		--iter;
+		Task *old = *iter;
+		if(old == task || old->isDirty()) {
+			continue;
+		}
+		iter = mLoadedBodies.erase(iter);
+		old->mBodyListed = false;
+		mBodyMemory -= old->mBodyLength;
+		// a task that got sub-tasks after it was loaded is kept
+		if(old->mSubTasks.empty()) {
+			old->unloadBody();
+		}
+	}
+}
+
+// Called when a task with a loaded body is deleted
+void Project::releaseBody(Task *task)
+{
+	mLoadedBodies.erase(task->mBodyEntry);
+	task->mBodyListed = false;
+	mBodyMemory -= task->mBodyLength;
+}
+
+// Forgets the loaded bodies before the tasks are deleted together
+void Project::clearBodies()
+{
+	for(auto task : mLoadedBodies) {
+		task->mBodyListed = false;
+	}
+	mLoadedBodies.clear();
+	mBodyMemory = 0;
+}
+
+// Sends the saved tasks to the url
+void Project::push(std::string url)
+{
+	if(!mTaskStorage) {
+		return;
+	}
+	commitAll();
+	mTaskStorage->push(url);
+}
+
+// Saves the changed tasks to a journal instead of writing the whole task
+// file. The journal is compacted to the task file in background when it
+// has max records.
+void Project::setJournal(unsigned int maxRecords)
+{
+	if(maxRecords && getJournalPath().empty()) {
+		throw "Journal needs a project directory";
+	}
+	mJournalLimit = maxRecords;
+	if(mJournalLimit) {
+		openJournal();
+	}
+}
+
+// Called by the writer after the changes. The readers see the new version
+// when they get the version the next time.
+void Project::publish()
+{
+	auto version = ProjectVersion::build(*std::atomic_load(&mVersion), mList.all());
+	std::atomic_store(&mVersion, version);
+}
+
+std::shared_ptr<const ProjectVersion> Project::getVersion() const
+{
+	return std::atomic_load(&mVersion);
+}
+
+std::string Project::getJournalPath() const
+{
+	if(!mTaskStorage) {
+		return mDirname.empty() ? "" : mDirname + "/tasker.journal";
+	}
+	std::string path = mTaskStorage->getPath();
+	return path.empty() ? "" : path + "tasker-journal";
+}
+
+// Opens the journal and applies the records that are not in the task file
+void Project::openJournal()
+{
+	if(mJournal) {
+		return;
+	}
+	mJournal = new Journal(getJournalPath());
+	mJournal->skipTo(mCompactedSeq);
+	for(const auto &record : mJournal->read(mCompactedSeq)) {
+		std::istringstream stream(record.task);
+		FJson::Reader in(stream);
+		mList.setTask(Task::read(this, in));
+	}
+	mList.markClean();
+}
+
+// Appends the changed tasks to the journal. The project file and the
+// removed tasks are not journaled so they are written by compacting.
+void Project::writeJournal()
+{
+	bool compact = mDirty || mList.hasRemovals()
+		|| mJournal->getRecordCount() >= mJournalLimit;
+	for(const auto &type : mTypes) {
+		compact |= type.second->isDirty();
+	}
+	if(compact) {
+		getSaveQueue()->push(snapshot(), true);
+		return;
+	}
+
+	mSaveStats = SaveStats();
+	std::vector<std::shared_ptr<const std::string> > tasks;
+	for(auto task : mList.all()) {
+		if(task->isDirty()) {
+			tasks.push_back(task->serialize());
+			mSaveStats.tasksWritten++;
+		} else {
+			mSaveStats.tasksSkipped++;
+		}
+	}
+	mJournal->append(tasks);
+	mList.markClean();
+}
+
+// Commits every change, also the ones that are only in the journal
+void Project::commitAll()
+{
+	flush();
+	store(snapshot());
+}
+
+// Merges the writes that happen within the window to a single commit,
+// the commit is also done when there are max pending writes.
+void Project::setGroupCommit(unsigned int windowMs, unsigned int maxPending)
+{
+	mGroupWindow = windowMs;
+	mGroupMaxPending = maxPending;
+	getSaveQueue()->setGroupCommit(windowMs, maxPending);
+}
+
+SaveQueue *Project::getSaveQueue()
+{
+	if(!mSaveQueue) {
+		mSaveQueue = new SaveQueue(this);
+	}
+	return mSaveQueue;
+}
+
+const Project::SaveStats &Project::getSaveStats() const
+{
+	return mSaveStats;
+}
+
+std::streambuf *Project::getOutStream(std::string path, size_t sizeHint)
+{
+	if(!mTaskStorage) {
+		return new AtomicFileBuffer(mDirname + "/" + path, sizeHint);
+	} else {
+		return mTaskStorage->addFile(path);
 	}
 }
 
@@ -1450,24 +2892,56 @@ std::streambuf *Project::getInStream(std::string path)
 
 		if(!buf->is_open()) return NULL;
 		return buf;
+	} else if(!mRevision.empty()) {
+		return mTaskStorage->getFile(path, mRevision);
 	} else {
 		return mTaskStorage->getFile(path);
 	}
 }
 
-void Project::writeMain()
+Project::SaveSnapshot Project::snapshot(bool force)
 {
-	if(mDirname.empty()) return;
+	if(!mRevision.empty()) {
+		throw "Project is opened at a revision and can't be written";
+	}
+	// if the previous save failed the files must be written again
+	force |= mStoreFailed.exchange(false);
+	// the journaled tasks are clean but they are not in the task file
+	if(mJournal && mJournal->getLastSeq() > mCompactedSeq) {
+		mCompactedSeq = mJournal->getLastSeq();
+		force = true;
+	}
+
+	mSaveStats = SaveStats();
+	SaveSnapshot snapshot;
+	snapshotMain(snapshot, force);
+	snapshotTasks(snapshot, force);
+	return snapshot;
+}
 
-	std::streambuf *buf = getOutStream("tasker.conf");
-	std::ostream stream(buf);
+bool Project::snapshotMain(SaveSnapshot &snapshot, bool force)
+{
+	if(mDirname.empty() && !mTaskStorage) return false;
+
+	// the next task id must be stored when the last task is removed
+	bool dirty = mDirty || mList.hasRemovals() || force;
+	for(const auto &type : mTypes) {
+		dirty |= type.second->isDirty();
+	}
+	if(!dirty) {
+		mSaveStats.filesSkipped++;
+		return false;
+	}
 
+	std::ostringstream stream;
 	FJson::Writer out(stream, true);
 	out.startObject();
 
 	out.writeObjectKey("types");
 	out.startObject();
-	for(const auto type : mTypes) {
+	// sorted by the name so that the file doesn't change without changes
+	std::map<std::string, TaskType*> types(mTypes.begin(), mTypes.end());
+	for(const auto &type : types) {
 		out.writeObjectKey(type.first);
 		type.second->write(out);
 	}
@@ -1479,35 +2953,131 @@ void Project::writeMain()
 
 	out.writeObjectKey("task-path");
 	out.write(mTaskFile);
+	if(!mIndexedCommit.empty()) {
+		out.writeObjectKey("indexed-commit");
+		out.write(mIndexedCommit);
+	}
+	if(mCompactedSeq) {
+		out.writeObjectKey("journal-seq");
+		out.write(mCompactedSeq);
+	}
+	out.writeObjectKey("next-task-id");
+	out.write(mList.getNextId());
 	out.write(mForeignKeys);
 	out.endObject();
 
-	delete buf;
+	FileSnapshot file;
+	file.path = "tasker.conf";
+	file.content = std::make_shared<const std::string>(stream.str());
+	file.journalSeq = mCompactedSeq;
+	snapshot.push_back(file);
+
+	mDirty = false;
+	for(const auto &type : mTypes) {
+		type.second->markClean();
+	}
+	mSaveStats.filesWritten++;
+	return true;
 }
 
-void Project::writeTasks()
+bool Project::snapshotTasks(SaveSnapshot &snapshot, bool force)
 {
-	std::streambuf *buf = getOutStream(mTaskFile);
-	std::ostream stream(buf);
+	auto tasks = mList.all();
+	bool dirty = mList.isDirty() || force;
+	for(const auto task : tasks) {
+		dirty |= task->isDirty();
+	}
+	if(!dirty) {
+		mSaveStats.tasksSkipped += tasks.size();
+		mSaveStats.filesSkipped++;
+		return false;
+	}
 
-	FJson::Writer out(stream, true);
+	FileSnapshot file;
+	file.path = mTaskFile;
+	file.journalSeq = 0;
+	file.elements.reserve(tasks.size());
+	for(const auto task : tasks) {
+		bool changed;
+		file.elements.push_back(task->serialize(&changed));
+		if(changed) {
+			mSaveStats.tasksWritten++;
+		} else {
+			mSaveStats.tasksSkipped++;
+		}
+	}
+	snapshot.push_back(file);
 
-	out.startArray();
-	for(const auto task : mList.all()) {
-		out.startNextElement();
-		task->write(out);
+	mList.markClean();
+	mSaveStats.filesWritten++;
+	return true;
+}
+
+// Writes the snapshot to the storage, this may be called from the
+// background thread so only the snapshot may be accessed.
+void Project::store(const SaveSnapshot &snapshot)
+{
+	for(const auto &file : snapshot) {
+		size_t size = file.content ? file.content->size() : 2;
+		for(const auto &element : file.elements) {
+			size += element->size() + 3;
+		}
+		std::streambuf *buf = getOutStream(file.path, size);
+		{
+			std::ostream stream(buf);
+			if(file.content) {
+				stream << *file.content;
+			} else {
+				FJson::Writer out(stream, true);
+				out.startArray();
+				for(const auto &element : file.elements) {
+					out.startNextElement();
+					out.writeRaw(*element);
+				}
+				out.endArray();
+			}
+		}
+		if(!mTaskStorage) {
+			try {
+				static_cast<AtomicFileBuffer*>(buf)->commit();
+			} catch(const char *e) {
+				delete buf;
+				throw;
+			}
+		}
+		delete buf;
 	}
-	out.endArray();
 
-	delete buf;
+	if(mTaskStorage && !snapshot.empty()) {
+		mTaskStorage->commit();
+	}
+	for(const auto &file : snapshot) {
+		if(file.journalSeq && mJournal) {
+			mJournal->truncate(file.journalSeq);
+		}
+	}
 }
 
 bool Project::read()
 {
-	if(mDirname.empty()) return false;
+	if(mDirname.empty() && !mTaskStorage) return false;
+	Arena::Scope scope(&mArena);
 
 	//create lock file
 
+	// the snapshot cache is only used for the current revision. It
+	// isn't used when the tasks are read lazily because it decodes every
+	// body, the lazy bodies are parsed from the task file when used.
+	SnapshotCache cache(mRevision.empty() && !mBodyBudget ? mTaskStorage : NULL);
+	if(cache.load(this)) {
+		mDirty = false;
+		mList.markClean();
+		if(mRevision.empty() && access(getJournalPath().c_str(), F_OK) == 0) {
+			openJournal();
+		}
+		return true;
+	}
+
 	std::streambuf *buf = getInStream("tasker.conf");
 	if(!buf) return false;
 	std::istream stream(buf);
@@ -1532,13 +3102,28 @@ bool Project::read()
 			}
 		} else if(key == "task-path") {
 			in.read(mTaskFile);
+		} else if(key == "indexed-commit") {
+			in.read(mIndexedCommit);
+		} else if(key == "journal-seq") {
+			in.read(mCompactedSeq);
+		} else if(key == "next-task-id") {
+			unsigned int nextId;
+			in.read(nextId);
+			mList.setNextId(nextId);
 		} else {
 			in.skipValue(&mForeignKeys, true);
 		}
 	}
 	delete buf;
 
-	if(!mTaskFile.empty()) {
+	if(!mTaskFile.empty() && mBodyBudget) {
+		std::streambuf *buf = getInStream(mTaskFile);
+		if(!buf) return false;
+		std::ostringstream content;
+		content << buf;
+		delete buf;
+		readLazy(std::make_shared<const std::string>(content.str()));
+	} else if(!mTaskFile.empty()) {
 		std::streambuf *buf = getInStream(mTaskFile);
 		if(!buf) return false;
 		std::istream stream(buf);
@@ -1551,30 +3136,85 @@ bool Project::read()
 		}
 		delete buf;
 	}
+	mDirty = false;
+	mList.markClean();
+	cache.save(this);
+	if(mRevision.empty() && access(getJournalPath().c_str(), F_OK) == 0) {
+		openJournal();
+	}
 	return true;
 }
 
-std::string Project::readText(FJson::Reader &in)
+// Reads only the metadata of the tasks, the bodies are read from the
+// content when they are used.
+void Project::readLazy(std::shared_ptr<const std::string> content)
 {
-	in.startArray();
-	std::ostringstream text;
-	while(in.hasNextElement()) {
-		std::string str;
-		in.read(str);
-		text << str;
+	auto index = TaskIndex::scan(content);
+	for(const auto &entry : index->getTasks()) {
+		mList.addTask(readLazyTask(content, entry.second.offset, entry.second.length));
 	}
-	return text.str();
 }
 
-void Project::writeText(FJson::Writer &out, std::string text)
+Task *Project::readLazyTask(std::shared_ptr<const std::string> content, size_t offset, size_t length)
 {
-	out.startArray();
-	std::vector<std::string> lines = split(text, '\n');
-	for(auto line : lines) {
-		out.startNextElement();
-		out.write(line + "\\n");
+	std::string lastDate;
+	bool hasSubTasks;
+	std::istringstream stream(TaskIndex::scanMetadata(*content, offset, &lastDate, &hasSubTasks));
+	FJson::Reader in(stream);
+
+	auto *task = new Task(this, "");
+	task->readFields(in, Task::METADATA);
+	task->mBodySource = content;
+	task->mBodyOffset = offset;
+	task->mBodyLength = length;
+	task->mLastActivity = lastDate.empty() ? task->mCreationDate : Date(lastDate);
+	if(hasSubTasks) {
+		// the sub-tasks are in the task tree, see touchBody()
+		task->loadBody();
 	}
-	out.endArray();
+	return task;
+}
+
+// Reads the project again after the repository has been changed under it
+void Project::reload()
+{
+	clearBodies();
+	mList.clear();
+	for(const auto &entry : mTypes) {
+		delete entry.second;
+	}
+	mTypes.clear();
+	mTaskFile.clear();
+	mForeignKeys = FJson::TokenCache();
+	delete mHistory;
+	mHistory = NULL;
+	if(!read()) {
+		throw "Couldn't read the project after merge";
+	}
+}
+
+std::string Project::readRevision(std::string path, std::string revision)
+{
+	std::streambuf *buf = mTaskStorage->getFile(path, revision);
+	if(!buf) {
+		return "";
+	}
+	std::ostringstream content;
+	content << buf;
+	delete buf;
+	return content.str();
+}
+
+std::string Project::readText(FJson::Reader &in)
+{
+	std::string text;
+	in.readLines(text);
+	return text;
+}
+
+void Project::writeText(FJson::Writer &out, std::string text)
+{
+	out.writeLines(text);
 }
 
 /// Config
@@ -1613,6 +3253,7 @@ static bool startsWith(std::string &prefix, std::string &value)
 
 std::string Config::getSourceDir(std::string taskerPath)
 {
+	std::lock_guard<std::mutex> lock(mConfig.mMutex);
 	for(auto *repository : Config::mConfig.mRepositories) {
 		if(repository->data == taskerPath) {
 			return repository->source;
@@ -1634,6 +3275,7 @@ std::string Config::guessProjectDir(std::string currentWorkDir)
 std::string Config::getTaskerData(std::string path, std::string *source)
 {
 	//TODO what if there is nested project, we should choose the deepest match
+	std::lock_guard<std::mutex> lock(mConfig.mMutex);
 	for(auto *repository : Config::mConfig.mRepositories) {
 		if(startsWith(repository->source, path)) {
 			if(source) {
@@ -1650,6 +3292,7 @@ std::string Config::getTaskerData(std::string path, std::string *source)
 
 void Config::setTaskerData(std::string source, std::string path)
 {
+	std::lock_guard<std::mutex> lock(mConfig.mMutex);
 	mConfig.addRepository(source, path);
 
 	//TODO lock the taskerconf file somehow
@@ -1,11 +1,21 @@
 #pragma once
 
+#include <ctime>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <set>
+#include <list>
+#include <memory>
+#include <atomic>
+#include <future>
+#include <mutex>
 
 #include "fjson/fjson.h"
+#include "symbol.h"
+#include "arena.h"
 
 namespace Tasker {
 namespace Backend {
@@ -14,6 +24,14 @@ class Task;
 class TaskType;
 class Project;
 class GitBackend;
+class SaveQueue;
+class TaskHistory;
+class SnapshotCache;
+class Journal;
+class TaskTree;
+class ProjectVersion;
+struct TaskColumns;
+struct MaintenanceReport;
 
 class User
 {
@@ -43,6 +61,7 @@ public:
 	void ownedBy(const TaskType *type);
 	void rename(std::string newName);
 	std::string getName() const;
+	Symbol getSymbol() const {return mName;};
 	unsigned int getId() const;
 	void ref();
 	void unref();
@@ -51,15 +70,17 @@ public:
 	static TaskState *read(TaskType *type, FJson::Reader &in);
 	void write(FJson::Writer &out) const;
 private:
-	TaskState(TaskType *type, std::string name);
-	TaskState(TaskType *type, std::string name, unsigned int id);
+	TaskState(TaskType *type, Symbol name);
+	TaskState(TaskType *type, Symbol name, unsigned int id);
 
 	TaskType *mType;
-	std::string mName;
+	Symbol mName;
 	unsigned int mId;
 	int mRefCount;
 	bool mIsDeleted;
 	FJson::TokenCache mForeignKeys;
+
+	friend SnapshotCache;
 };
 
 class TaskType
@@ -78,6 +99,9 @@ public:
 	const std::set<TaskState*> possibleChanges(TaskState *from) const;
 	bool isClosed(TaskState *state) const;
 	bool isIncomplete() const;
+	bool isDirty() const;
+	void markDirty();
+	void markClean();
 
 	static TaskType *read(Project *project, FJson::Reader &in);
 	void write(FJson::Writer &out) const;
@@ -90,41 +114,81 @@ private:
 	Project *mProject;
 	std::string mName;
 	bool mIsDeleted;
+	bool mDirty;
 	TaskState *mStartState;
 	std::set<TaskState*> mEndStates;
 	std::map<TaskState*, std::set<TaskState*> > mStateMap;
 	std::vector<TaskState*> mStates;
 	FJson::TokenCache mForeignKeys;
+
+	friend SnapshotCache;
 };
 
+// UTC time in seconds since the epoch. The machine time is ISO 8601 in
+// the form 2017-04-23T14:51:00Z.
 class Date
 {
 public:
-	Date(std::string date);
-	Date(const Date &date);
+	Date(const std::string &date);
+	Date(time_t time) :mTime(time) {};
 	Date();
-	~Date();
 
 	std::string getMachineTime() const;
+	time_t getTimestamp() const {return mTime;};
 	std::string getFormattedTime(std::string format) const;
-	int cmp(const Date &other) const;
-	Date &operator=(const Date &other);
-	bool operator==(const Date &other) {return cmp(other) == 0;};
-	bool operator!=(const Date &other) {return cmp(other) != 0;};
-	bool operator<(const Date &other) {return cmp(other) < 0;};
-	bool operator>(const Date &other) {return cmp(other) > 0;};
-	bool operator<=(const Date &other) {return cmp(other) <= 0;};
-	bool operator>=(const Date &other) {return cmp(other) >= 0;};
+	int cmp(const Date &other) const {return (mTime > other.mTime) - (mTime < other.mTime);};
+	bool operator==(const Date &other) const {return mTime == other.mTime;};
+	bool operator!=(const Date &other) const {return mTime != other.mTime;};
+	bool operator<(const Date &other) const {return mTime < other.mTime;};
+	bool operator>(const Date &other) const {return mTime > other.mTime;};
+	bool operator<=(const Date &other) const {return mTime <= other.mTime;};
+	bool operator>=(const Date &other) const {return mTime >= other.mTime;};
 private:
-	struct tm *mTime;//TODO smart pointer?
+	static int64_t daysFromCivil(int64_t year, unsigned int month, unsigned int day);
+	static void civilFromDays(int64_t days, struct tm *time);
+	static long getLocalOffset(time_t time);
+
+	int64_t mTime;
 };
 
-//class TaskEvent;
-//typedef TaskEvent *(*TaskConstructor)();
+// A change of a task field in the task repository. The values are the
+// stored values and empty when the task did not exist.
+struct TaskChange {
+	std::string commit;
+	Date date;
+	std::string field;
+	std::string before;
+	std::string after;
+};
+
+// A task that differs between two revisions. The events are the types of
+// the events that the older revision didn't have.
+struct TaskDiff {
+	enum Kind {ADDED, REMOVED, MODIFIED};
+	unsigned int id;
+	Kind kind;
+	std::string name;
+	std::vector<std::string> fields;
+	std::vector<std::string> events;
+};
 
+// An event of a task. The kind of the event is stored in the event so
+// that the events can be handled without RTTI, as<T>() returns the event
+// as the subclass of the kind. Every event is still its own object
+// because getEvents() hands out event pointers that the callers keep
+// while events are added. The events that are read together are
+// allocated one after another in the project arena.
 class TaskEvent
 {
 public:
+	enum Kind {
+		STATE_CHANGE,
+		COMMENT,
+		TASK_REF,
+		COMMIT_REF,
+		KIND_COUNT
+	};
+
 	virtual ~TaskEvent();
 	static TaskEvent *read(Project *project, FJson::Reader &in);
 	void write(FJson::Writer &out) const;
@@ -133,65 +197,98 @@ public:
 	User *getUser() const;
 	void setTask(Task *task);
 
-	virtual std::string getName() const {return "unknown";};
+	Kind getKind() const {return mKind;};
+	std::string getName() const;
+	template<typename T> T *as() {return mKind == T::KIND ? static_cast<T*>(this) : NULL;};
+	template<typename T> const T *as() const {return mKind == T::KIND ? static_cast<const T*>(this) : NULL;};
+
+	static void *operator new(size_t size) {return Arena::allocateObject(size);};
+	static void operator delete(void *p, size_t size) {Arena::releaseObject(p, size);};
 protected:
-	TaskEvent();
-	TaskEvent(Task *task);
+	TaskEvent(Kind kind);
+	TaskEvent(Kind kind, Task *task);
+	TaskEvent(Kind kind, Task *task, const Date &date);
 	Task *getTask() const;
 private:
+	struct KindInfo {
+		Symbol name;
+		TaskEvent *(*create)();
+	};
+	static const KindInfo *getKinds();
+	static TaskEvent *create(Symbol type);
+	static TaskEvent *create(Kind kind);
 	virtual bool readInternal(FJson::Reader &in, std::string key) {return false;};
 	virtual void writeEvent(FJson::Writer &out) const {};
 
+	Kind mKind;
 	User *mUser;
 	Task *mTask;
 	Date mDate;
 	FJson::TokenCache mForeignKeys;
+
+	friend SnapshotCache;
 };
 
 class StateChangeEvent : public TaskEvent
 {
 public:
-	StateChangeEvent() {};
+	static const Kind KIND = STATE_CHANGE;
+
+	StateChangeEvent() :TaskEvent(KIND) {};
 	StateChangeEvent(Task *task, TaskState *from, TaskState *to);
 
 	TaskState *from() const;
 	TaskState *to() const;
 private:
-	std::string getName() const override { return "STATE_CHANGE"; }
 	bool readInternal(FJson::Reader &in, std::string key) override;
 	void writeEvent(FJson::Writer &out) const override;
 	unsigned int mFromState, mToState;
+
+	friend SnapshotCache;
 };
 
 class CommentEvent : public TaskEvent
 {
 public:
-	CommentEvent() {};
+	static const Kind KIND = COMMENT;
+
+	CommentEvent() :TaskEvent(KIND) {};
 	CommentEvent(Task *task, std::string content);
 	const std::string getContent() const {return mContent;};
 private:
-	std::string getName() const override { return "COMMENT"; }
 	bool readInternal(FJson::Reader &in, std::string key) override;
 	void writeEvent(FJson::Writer &out) const override;
 
 	std::string mContent;
+
+	friend SnapshotCache;
 };
 
 class ReferenceEvent : public TaskEvent
 {
+public:
+	static const Kind KIND = TASK_REF;
+
+	ReferenceEvent() :TaskEvent(KIND) {};
 private:
-	std::string getName() const override { return "TASK_REF"; }
 	bool readInternal(FJson::Reader &in, std::string key) override {return false;};
 	void writeEvent(FJson::Writer &out) const override {};
 };
 
 class CommitEvent : public TaskEvent
 {
+public:
+	static const Kind KIND = COMMIT_REF;
+
+	CommitEvent() :TaskEvent(KIND) {};
+	CommitEvent(Task *task, std::string commit, const Date &date);
+	const std::string getCommit() const {return mCommit;};
 private:
-	std::string getName() const override { return "COMMIT_REF"; }
 	bool readInternal(FJson::Reader &in, std::string key) override;
 	void writeEvent(FJson::Writer &out) const override;
 	std::string mCommit;
+
+	friend SnapshotCache;
 };
 
 class Task
@@ -222,11 +319,30 @@ public:
 	void addEvent(TaskEvent *event);
 	const std::vector<TaskEvent*> getEvents() const;
 
+	const Date getLastActivity() const;
+
 	bool isClosed() const;
+	bool isDirty() const;
+	uint64_t getChangeCount() const;
+	uint64_t getBodyChangeCount() const;
 	static Task *read(Project *project, FJson::Reader &in);
 	void write(FJson::Writer &out) const;
+	std::shared_ptr<const std::string> serialize(bool *changed = NULL);
 
+	static void *operator new(size_t size) {return Arena::allocateObject(size);};
+	static void operator delete(void *p, size_t size) {Arena::releaseObject(p, size);};
 private:
+	enum Fields {
+		METADATA = 1,//< id, name, type, state, assignee and creation time
+		BODY = 2//< description, sub-tasks, events and unknown fields
+	};
+	void readFields(FJson::Reader &in, int fields);
+	void loadBody() const;
+	void unloadBody();
+	void markDirty(bool body = false);
+	void markClean();
+	void touchType(const TaskType *type);
+
 	Project *mProject;
 	int mId;
 	std::string mName;
@@ -237,9 +353,29 @@ private:
 	Date mCreationDate;
 	Task *mParent;
 	FJson::TokenCache mForeignKeys;
-
-	std::vector<TaskEvent*> mEvents;
-	std::vector<Task*> mSubTasks;
+	bool mDirty;
+	uint64_t mChangeCount;//< unique for every change of every task
+	uint64_t mBodyChangeCount;//< the change count of the last change to the body
+	std::shared_ptr<const std::string> mCache;//< serialized task from the last save
+
+	SmallVector<TaskEvent*, 4> mEvents;
+	SmallVector<Task*, 4> mSubTasks;
+
+	// the unparsed task when the project is read lazily, the body is
+	// parsed from it when it is used
+	std::shared_ptr<const std::string> mBodySource;
+	size_t mBodyOffset, mBodyLength;
+	bool mBodyLoaded;
+	bool mBodyListed;//< mBodyEntry is in the loaded bodies of the project
+	Date mLastActivity;//< while the body isn't loaded
+	std::list<Task*>::iterator mBodyEntry;
+
+	friend SnapshotCache;
+	friend Project;
+	friend TaskType;
+	friend TaskTree;
+	friend TaskColumns;
+	friend ProjectVersion;
 };
 
 class TaskFilter
@@ -261,6 +397,7 @@ public:
 	TaskFilter *clone() const;
 	TaskFilter::TaskFilterWrapper wrap();
 	bool getValue(const Task *task);
+	void select(const TaskColumns &columns, std::vector<uint8_t> &mask);
 private:
 	static std::string lower(std::string str);
 
@@ -278,7 +415,7 @@ private:
 	bool mIsOpen;
 	std::string mQuery;
 	TaskFilter *mFirst, *mSecond;
-	std::string mState;
+	Symbol mState;
 };
 
 class SearchException : public std::exception {
@@ -312,18 +449,114 @@ private:
 	std::istream &mStream;
 };
 
+// Writes a file so that it is either the old or the new version after a
+// crash. The data goes to a temporary file next to the file and commit()
+// renames it over the file. Without commit() the file isn't changed.
+class AtomicFileBuffer : public std::streambuf
+{
+public:
+	static const size_t BUFFER_SIZE = 1 << 20;
+	static const size_t DIRECT_THRESHOLD = 64 << 20;//< size hint for O_DIRECT
+
+	AtomicFileBuffer(std::string path, size_t sizeHint = 0);
+	~AtomicFileBuffer();
+	void commit();
+protected:
+	int overflow(int c) override;
+	int sync() override;
+private:
+	bool writeBuffer();
+
+	std::string mPath;
+	std::string mTemp;
+	int mFd;
+	bool mDirect;
+	bool mFailed;
+	char *mBuffer;
+	size_t mWritten;
+};
+
+// The fields that are used to filter and sort the tasks as arrays that
+// have a row for every node of the task tree
+struct TaskColumns {
+	std::vector<Task*> task;
+	std::vector<Symbol> state;
+	std::vector<const TaskType*> type;
+	std::vector<const User*> assigned;
+	std::vector<uint8_t> open;
+	std::vector<int64_t> created;
+	std::vector<int64_t> activity;
+
+	void resize(size_t rows);
+	void set(size_t row, Task *task);
+};
+
+// All tasks and sub-tasks in depth first order so that the sub-tasks of
+// a node are the nodes from the node to its end. The path of a sub-task
+// is the path of the parent and its own id, for example 12.3. The lazily
+// read tasks that have sub-tasks are always loaded so the tree has every
+// sub-task.
+class TaskTree
+{
+public:
+	struct Node {
+		Task *task;
+		std::string path;
+		int parent;//< index of the parent node, -1 for the top level tasks
+		unsigned int end;//< index after the last node of the sub-tasks
+	};
+
+	void build(const std::vector<Task*> &tasks);
+	const std::vector<Node> &getNodes() const;
+	const Node *find(const std::string &path) const;
+	std::string getPath(const Task *task) const;
+	std::vector<const Node*> getFiltered(TaskFilter *filter) const;
+	void sortByActivity(std::vector<const Node*> &nodes) const;
+	const TaskColumns &getColumns() const;
+	void update(Task *task);
+private:
+	void add(Task *task, const std::string &path, int parent);
+
+	std::vector<Node> mNodes;
+	TaskColumns mColumns;
+	std::unordered_map<std::string, unsigned int> mPaths;
+	std::unordered_map<const Task*, unsigned int> mIndex;
+};
+
 class TaskList
 {
 public:
+	TaskList();
 	~TaskList();
 	void addTask(Task *task);
 	void removeTask(Task *task);
 	Task *getTask(unsigned int id);
 	const std::vector<Task*> all() const;
-	const std::vector<Task*> getFiltered(TaskFilter *filter) const;
+	const std::vector<Task*> getFiltered(TaskFilter *filter);
 	unsigned int getSize() const;
+	void setTask(Task *task);
+	bool isDirty() const;
+	bool hasRemovals() const;
+	void markClean();
+	void clear();
+	unsigned int getNextId() const;
+	void setNextId(unsigned int id);
+	const TaskTree &getTree();
+	Task *findTask(const std::string &path);
+	void invalidateTree();
+	void updateTask(Task *task);
 private:
-	std::vector<Task*> mTasks;
+	void compact();
+
+	TaskTree mTree;
+	bool mTreeValid;
+
+	bool mDirty;
+	bool mRemoved;
+	std::vector<Task*> mTasks;//< in the order of addition, NULL if removed
+	std::unordered_map<unsigned int, size_t> mSlots;//< id to index of mTasks
+	size_t mTombstones;
+	unsigned int mNextId;//< ids of removed tasks aren't reused
 	FJson::TokenCache mForeignKeys;
 	void getTaskId(Task *task, unsigned int id);
 };
@@ -331,41 +564,126 @@ private:
 class Project
 {
 public:
+	struct SaveStats {
+		unsigned int tasksWritten;
+		unsigned int tasksSkipped;
+		unsigned int filesWritten;
+		unsigned int filesSkipped;
+	};
+
+	struct MergeStats {
+		unsigned int tasksMerged;
+		unsigned int conflicts;//< fields changed on both sides, our value is kept
+		unsigned int tasksRenumbered;
+		unsigned int tasksRead;//< tasks parsed again from the merged task file
+	};
+
 	static Project *create(std::string dirname);
-	static Project *open(std::string dirname);
+	static Project *open(std::string dirname, size_t bodyBudget = 0);
+	static Project *createInMemory();
+	static Project *clone(std::string url, std::string dirname);
+	static Project *openAt(std::string dirname, std::string revision);
+	static Project *openAt(std::string dirname, const Date &date);
 
 	Project(); //< open for tests
 	~Project();
 	User *getDefaultUser();
-	User *getUser(std::string name);
-	TaskType *getType(std::string name);
+	User *getUser(Symbol name);
+	TaskType *getType(Symbol name);
 	TaskList *getTaskList();
 
 	static std::string readText(FJson::Reader &in);
 	static void writeText(FJson::Writer &out, std::string text);
 
 	void write();//< TODO make private
+	std::future<void> writeAsync();
+	void flush();
+	void setGroupCommit(unsigned int windowMs, unsigned int maxPending = 0);
+	const SaveStats &getSaveStats() const;
+	MaintenanceReport maintain();
+	std::string getDirname() const;
+	std::vector<TaskChange> getTaskHistory(unsigned int id);
+	std::vector<TaskDiff> diff(std::string from, std::string to);
+	unsigned int indexCommits();
+	bool setSource(std::string path);
+	MergeStats pull(std::string url);
+	void push(std::string url);
+	void setBodyBudget(size_t bytes);
+	void setJournal(unsigned int maxRecords);
+	void publish();
+	std::shared_ptr<const ProjectVersion> getVersion() const;
 private:
+	// Contents of a file at the moment of the save. The task file is
+	// stored as serialized array elements that are joined while storing.
+	struct FileSnapshot {
+		std::string path;
+		std::shared_ptr<const std::string> content;
+		std::vector<std::shared_ptr<const std::string> > elements;
+		unsigned int journalSeq;//< the journal records stored with this file
+	};
+	typedef std::vector<FileSnapshot> SaveSnapshot;
+
 	User *mDefaultUser;
+	bool mDirty;
+	SaveStats mSaveStats;
+	SaveQueue *mSaveQueue;
+	std::atomic<bool> mStoreFailed;
+	unsigned int mGroupWindow;
+	unsigned int mGroupMaxPending;
 	std::string mDirname;
+	std::string mRevision;//< read only snapshot of this commit if set
 	std::string mTaskFile;
-	std::map<std::string, TaskType*> mTypes;
-	std::map<std::string, User*> mUsers;
+	std::string mIndexedCommit;//< newest source commit scanned for task references
+	Arena mArena;//< the tasks and the events read from the files
+	std::unordered_map<Symbol, TaskType*> mTypes;
+	std::unordered_map<Symbol, User*> mUsers;
 	TaskList mList;
 	FJson::TokenCache mForeignKeys;
 
 	GitBackend *mSrcStorage, *mTaskStorage;
+	TaskHistory *mHistory;
+
+	size_t mBodyBudget;//< bytes of loaded task bodies, 0 reads the tasks fully
+	size_t mBodyMemory;
+	std::list<Task*> mLoadedBodies;//< most recently used first
+
+	Journal *mJournal;
+	unsigned int mJournalLimit;//< records before compaction, 0 disables the journal
+	unsigned int mCompactedSeq;//< the last journal record in the task file
+
+	std::shared_ptr<const ProjectVersion> mVersion;//< the readers load it atomically
 
 	bool read();
-	void writeMain();
-	void writeTasks();
-	std::streambuf *getOutStream(std::string path);
+	void readLazy(std::shared_ptr<const std::string> content);
+	Task *readLazyTask(std::shared_ptr<const std::string> content, size_t offset, size_t length);
+	bool applyMerge(const std::string &ourConfig, const std::string &config,
+		std::shared_ptr<const std::string> tasks, MergeStats &stats);
+	void touchBody(Task *task);
+	void releaseBody(Task *task);
+	void clearBodies();
+	std::string getJournalPath() const;
+	void openJournal();
+	void writeJournal();
+	void commitAll();
+	void reload();
+	std::string readRevision(std::string path, std::string revision);
+	SaveSnapshot snapshot(bool force = false);
+	bool snapshotMain(SaveSnapshot &snapshot, bool force);
+	bool snapshotTasks(SaveSnapshot &snapshot, bool force);
+	void store(const SaveSnapshot &snapshot);
+	SaveQueue *getSaveQueue();
+	std::streambuf *getOutStream(std::string path, size_t sizeHint = 0);
 	std::streambuf *getInStream(std::string path);
 
 	friend TaskType;
+	friend Task;
+	friend SaveQueue;
+	friend SnapshotCache;
 };
 
-class Config//< TODO this object should be thread safe
+// The repositories are guarded by a mutex, the default user is only set
+// when the config is read
+class Config
 {
 public:
 	static User *getDefaultUser();
@@ -385,6 +703,7 @@ private:
 	FJson::TokenCache mForeignKeys;
 	std::vector<Repository*> mRepositories;
 	User *mDefaultUser;
+	std::mutex mMutex;
 
 	void readHomeConfig();
 	void readRepository(FJson::Reader &in);
@@ -0,0 +1,437 @@
+/* Binary snapshot cache of the project
+ *
+ * Copyright (C) 2017 Aleksi Salmela
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <cstring>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "git.h"
+
+namespace Tasker {
+namespace Backend {
+
+static const char *CACHE_MAGIC = "tasker-snapshot-4";
+
+/// Input
+
+// Reads the values from the mapped file, every read is checked against
+// the end of the file. The strings are copied out of the mapping.
+class SnapshotCache::Input
+{
+public:
+	Input(const char *data, size_t size)
+		:mPos(data), mEnd(data + size) {}
+
+	template<typename T> T read()
+	{
+		T value;
+		readBytes(&value, sizeof(T));
+		return value;
+	}
+
+	std::string readString()
+	{
+		uint32_t length = read<uint32_t>();
+		check(length);
+		std::string str(mPos, length);
+		mPos += length;
+		return str;
+	}
+
+	void readBytes(void *value, size_t length)
+	{
+		check(length);
+		memcpy(value, mPos, length);
+		mPos += length;
+	}
+private:
+	void check(size_t length) const
+	{
+		if((size_t)(mEnd - mPos) < length) {
+			throw "Truncated snapshot cache";
+		}
+	}
+
+	const char *mPos;
+	const char *mEnd;
+};
+
+/// Output
+
+class SnapshotCache::Output
+{
+public:
+	template<typename T> void write(T value)
+	{
+		mData.append((const char*)&value, sizeof(T));
+	}
+
+	void writeString(const std::string &str)
+	{
+		write<uint32_t>(str.size());
+		mData.append(str);
+	}
+
+	const std::string &getData() const
+	{
+		return mData;
+	}
+private:
+	std::string mData;
+};
+
+/// SnapshotCache
+
+SnapshotCache::SnapshotCache(GitBackend *storage)
+	:mStorage(storage)
+{
+	std::string path = storage ? storage->getPath() : "";
+	if(!path.empty()) {
+		mPath = path + "tasker-cache/snapshot";
+	}
+}
+
+// Reads the project from the cache if the cache has been made from the
+// files in HEAD. Nothing is changed in the project if this fails.
+bool SnapshotCache::load(Project *project)
+{
+	if(mPath.empty()) {
+		return false;
+	}
+	int fd = open(mPath.c_str(), O_RDONLY);
+	if(fd < 0) {
+		return false;
+	}
+	struct stat info;
+	if(fstat(fd, &info) || info.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) {
+		return false;
+	}
+
+	bool loaded = false;
+	std::string taskFile, indexedCommit;
+	unsigned int compactedSeq = 0, nextId = 1;
+	FJson::TokenCache foreignKeys;
+	std::unordered_map<Symbol, TaskType*> types;
+	std::vector<Task*> tasks;
+	try {
+		Input in((const char*)data, info.st_size);
+		std::string conf = in.readString() == CACHE_MAGIC ? in.readString() : "";
+		taskFile = in.readString();
+		std::string taskBlob = in.readString();
+		if(!conf.empty() && conf == mStorage->getFileId("tasker.conf", "HEAD")
+			&& (taskFile.empty() || taskBlob == mStorage->getFileId(taskFile, "HEAD"))) {
+			indexedCommit = in.readString();
+			compactedSeq = in.read<uint32_t>();
+			nextId = in.read<uint32_t>();
+			readKeys(in, foreignKeys);
+			for(uint32_t i = in.read<uint32_t>(); i > 0; i--) {
+				std::string name = in.readString();
+				types[name] = readType(in, project);
+			}
+			for(uint32_t i = in.read<uint32_t>(); i > 0; i--) {
+				tasks.push_back(readTask(in, project, types));
+			}
+			loaded = true;
+		}
+	} catch(const char *e) {
+	}
+	munmap(data, info.st_size);
+
+	if(!loaded) {
+		for(auto task : tasks) {
+			delete task;
+		}
+		for(const auto &type : types) {
+			delete type.second;
+		}
+		return false;
+	}
+	project->mTaskFile = taskFile;
+	project->mIndexedCommit = indexedCommit;
+	project->mCompactedSeq = compactedSeq;
+	project->mForeignKeys = foreignKeys;
+	project->mTypes.insert(types.begin(), types.end());
+	for(auto task : tasks) {
+		project->mList.addTask(task);
+	}
+	project->mList.setNextId(nextId);
+	return true;
+}
+
+// Writes the project to the cache. The project must be equal to the files
+// in HEAD. The cache is only an optimization so failures are ignored.
+void SnapshotCache::save(const Project *project)
+{
+	if(mPath.empty()) {
+		return;
+	}
+	std::string conf = mStorage->getFileId("tasker.conf", "HEAD");
+	if(conf.empty()) {
+		return;
+	}
+	Output out;
+	out.writeString(CACHE_MAGIC);
+	out.writeString(conf);
+	out.writeString(project->mTaskFile);
+	out.writeString(project->mTaskFile.empty() ? "" : mStorage->getFileId(project->mTaskFile, "HEAD"));
+	out.writeString(project->mIndexedCommit);
+	out.write<uint32_t>(project->mCompactedSeq);
+	out.write<uint32_t>(project->mList.getNextId());
+	writeKeys(out, project->mForeignKeys);
+
+	out.write<uint32_t>(project->mTypes.size());
+	for(const auto &type : project->mTypes) {
+		out.writeString(type.first);
+		writeType(out, type.second);
+	}
+	auto tasks = project->mList.all();
+	out.write<uint32_t>(tasks.size());
+	for(auto task : tasks) {
+		writeTask(out, task);
+	}
+
+	// the other processes see either the old or the new cache
+	std::string dir = mPath.substr(0, mPath.rfind('/'));
+	mkdir(dir.c_str(), 0755);
+	std::string temp = mPath + "." + std::to_string(getpid());
+	FILE *file = fopen(temp.c_str(), "wb");
+	if(!file) {
+		return;
+	}
+	const std::string &data = out.getData();
+	bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+	written &= fclose(file) == 0;
+	if(!written || rename(temp.c_str(), mPath.c_str())) {
+		unlink(temp.c_str());
+	}
+}
+
+void SnapshotCache::writeType(Output &out, const TaskType *type)
+{
+	out.writeString(type->mName);
+	out.write<uint8_t>(type->mIsDeleted);
+	writeKeys(out, type->mForeignKeys);
+
+	out.write<uint32_t>(type->mStates.size());
+	for(auto state : type->mStates) {
+		out.write<uint8_t>(state != NULL);
+		if(state) {
+			out.writeString(state->mName);
+			writeKeys(out, state->mForeignKeys);
+		}
+	}
+	out.write<uint32_t>(type->mStartState ? type->mStartState->getId() : TaskState::INVALID_ID);
+	out.write<uint32_t>(type->mEndStates.size());
+	for(auto state : type->mEndStates) {
+		out.write<uint32_t>(state->getId());
+	}
+	out.write<uint32_t>(type->mStateMap.size());
+	for(const auto &entry : type->mStateMap) {
+		out.write<uint32_t>(entry.first->getId());
+		out.write<uint32_t>(entry.second.size());
+		for(auto state : entry.second) {
+			out.write<uint32_t>(state->getId());
+		}
+	}
+}
+
+TaskType *SnapshotCache::readType(Input &in, Project *project)
+{
+	TaskType *type = new TaskType(NULL, "");
+	type->mProject = project;
+	try {
+		auto getState = [type](unsigned int id) {
+			TaskState *state = type->getStateById(id);
+			if(!state) {
+				throw "Unknown state in snapshot cache";
+			}
+			return state;
+		};
+		type->mName = in.readString();
+		type->mIsDeleted = in.read<uint8_t>();
+		readKeys(in, type->mForeignKeys);
+
+		uint32_t count = in.read<uint32_t>();
+		for(uint32_t id = 0; id < count; id++) {
+			if(in.read<uint8_t>()) {
+				auto state = new TaskState(type, in.readString(), id);
+				readKeys(in, state->mForeignKeys);
+			}
+		}
+		type->mStartState = getState(in.read<uint32_t>());
+		for(uint32_t i = in.read<uint32_t>(); i > 0; i--) {
+			type->mEndStates.insert(getState(in.read<uint32_t>()));
+		}
+		for(uint32_t i = in.read<uint32_t>(); i > 0; i--) {
+			auto &set = type->mStateMap[getState(in.read<uint32_t>())];
+			for(uint32_t j = in.read<uint32_t>(); j > 0; j--) {
+				set.insert(getState(in.read<uint32_t>()));
+			}
+		}
+	} catch(const char *e) {
+		delete type;
+		throw;
+	}
+	type->mDirty = false;
+	return type;
+}
+
+void SnapshotCache::writeTask(Output &out, const Task *task)
+{
+	out.write<int32_t>(task->mId);
+	out.writeString(task->mName);
+	out.writeString(task->mDesc);
+	out.writeString(task->mType->getName());
+	out.write<uint32_t>(task->mState->getId());
+	out.writeString(task->mAssigned != User::ANONYMOUS ? task->mAssigned->getName() : "");
+	out.write<int64_t>(task->mCreationDate.getTimestamp());
+	writeKeys(out, task->mForeignKeys);
+
+	out.write<uint32_t>(task->mSubTasks.size());
+	for(auto subTask : task->mSubTasks) {
+		writeTask(out, subTask);
+	}
+	out.write<uint32_t>(task->mEvents.size());
+	for(auto event : task->mEvents) {
+		writeEvent(out, event);
+	}
+}
+
+Task *SnapshotCache::readTask(Input &in, Project *project,
+	const std::unordered_map<Symbol, TaskType*> &types)
+{
+	auto *task = new Task(project, "");
+	try {
+		task->mId = in.read<int32_t>();
+		task->mName = in.readString();
+		task->mDesc = in.readString();
+		auto type = types.find(Symbol(in.readString()));
+		if(type == types.end()) {
+			throw "Unknown type in snapshot cache";
+		}
+		task->mType = type->second;
+		task->mState = task->mType->getStateById(in.read<uint32_t>());
+		if(!task->mState) {
+			throw "Unknown state in snapshot cache";
+		}
+		std::string assigned = in.readString();
+		if(!assigned.empty()) {
+			task->mAssigned = project->getUser(assigned);
+		}
+		task->mCreationDate = Date((time_t)in.read<int64_t>());
+		readKeys(in, task->mForeignKeys);
+
+		for(uint32_t i = in.read<uint32_t>(); i > 0; i--) {
+			task->addSubTask(readTask(in, project, types));
+		}
+		for(uint32_t i = in.read<uint32_t>(); i > 0; i--) {
+			auto *event = readEvent(in, project);
+			event->setTask(task);
+			task->mEvents.push_back(event);
+		}
+	} catch(const char *e) {
+		delete task;
+		throw;
+	}
+	task->mDirty = false;
+	return task;
+}
+
+void SnapshotCache::writeEvent(Output &out, const TaskEvent *event)
+{
+	out.write<uint8_t>(event->getKind());
+	out.write<int64_t>(event->mDate.getTimestamp());
+	out.writeString(event->mUser != User::ANONYMOUS ? event->mUser->getName() : "");
+	writeKeys(out, event->mForeignKeys);
+
+	if(auto *change = event->as<StateChangeEvent>()) {
+		out.write<uint32_t>(change->mFromState);
+		out.write<uint32_t>(change->mToState);
+	} else if(auto *comment = event->as<CommentEvent>()) {
+		out.writeString(comment->mContent);
+	} else if(auto *commit = event->as<CommitEvent>()) {
+		out.writeString(commit->mCommit);
+	}
+}
+
+TaskEvent *SnapshotCache::readEvent(Input &in, Project *project)
+{
+	TaskEvent *event = TaskEvent::create((TaskEvent::Kind)in.read<uint8_t>());
+	try {
+		event->mDate = Date((time_t)in.read<int64_t>());
+		std::string user = in.readString();
+		if(!user.empty()) {
+			event->mUser = project->getUser(user);
+		}
+		readKeys(in, event->mForeignKeys);
+
+		if(auto *change = event->as<StateChangeEvent>()) {
+			change->mFromState = in.read<uint32_t>();
+			change->mToState = in.read<uint32_t>();
+		} else if(auto *comment = event->as<CommentEvent>()) {
+			comment->mContent = in.readString();
+		} else if(auto *commit = event->as<CommitEvent>()) {
+			commit->mCommit = in.readString();
+		}
+	} catch(const char *e) {
+		delete event;
+		throw;
+	}
+	return event;
+}
+
+void SnapshotCache::writeKeys(Output &out, const FJson::TokenCache &keys)
+{
+	auto tokens = keys.getTokens();
+	out.write<uint32_t>(tokens.size());
+	for(const auto &token : tokens) {
+		out.write<uint8_t>(token.type);
+		out.writeString(token.string);
+		out.write(token.value);
+	}
+}
+
+void SnapshotCache::readKeys(Input &in, FJson::TokenCache &keys)
+{
+	for(uint32_t i = in.read<uint32_t>(); i > 0; i--) {
+		uint8_t type = in.read<uint8_t>();
+		if(type > FJson::END) {
+			throw "Unknown token in snapshot cache";
+		}
+		FJson::Token token((FJson::TokenType)type);
+		token.string = in.readString();
+		in.readBytes(&token.value, sizeof(token.value));
+		keys.record(token);
+	}
+}
+
+};
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+#include "backend.h"
+
+namespace Tasker {
+namespace Backend {
+
+// Binary copy of the whole project next to the task repository. The copy
+// is keyed by the blob ids of tasker.conf and the task file so it is used
+// only when it has been made from the committed files.
+//
+// The file is decoded in one pass into new objects, it isn't used in
+// place. The model keeps its names in std::string and Symbol and its
+// objects in the project arena, so nothing could point into the mapping.
+// The gain over the JSON is that there is no tokenizing, no escapes and
+// no key lookups. The decoder sets the private fields directly like the
+// JSON readers do, that is why the classes are friends of this one.
+class SnapshotCache
+{
+public:
+	SnapshotCache(GitBackend *storage);
+
+	bool load(Project *project);
+	void save(const Project *project);
+private:
+	class Input;
+	class Output;
+
+	static void writeType(Output &out, const TaskType *type);
+	static TaskType *readType(Input &in, Project *project);
+	static void writeTask(Output &out, const Task *task);
+	static Task *readTask(Input &in, Project *project,
+		const std::unordered_map<Symbol, TaskType*> &types);
+	static void writeEvent(Output &out, const TaskEvent *event);
+	static TaskEvent *readEvent(Input &in, Project *project);
+	static void writeKeys(Output &out, const FJson::TokenCache &keys);
+	static void readKeys(Input &in, FJson::TokenCache &keys);
+
+	GitBackend *mStorage;
+	std::string mPath;
+};
+
+};
+};
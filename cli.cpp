@@ -25,6 +25,8 @@
 #include <fstream>
 #include <string>
 #include <exception>
+#include <future>
+#include <chrono>
 #include <unistd.h>
 
 #ifndef _NO_READLINE_
@@ -33,6 +35,7 @@
 #endif
 
 #include "backend.h"
+#include "git.h"
 #include "cli.h"
 
 int main(int argc, char **argv)
@@ -331,23 +334,109 @@ void TaskListView::view(CliInterface *parent)
 		std::cout << "   [Empty]\n";
 	}
 
-	auto sort = [](const Backend::Task *first, const Backend::Task *second) {
-		Backend::Date firstDate = first->getCreationDate();
-		Backend::Date secondDate = second->getCreationDate();
-		if(!first->getEvents().empty())
-			firstDate = first->getEvents().back()->getCreationDate();
-		if(!second->getEvents().empty())
-			secondDate = second->getEvents().back()->getCreationDate();
-		return firstDate > secondDate;
-	};
+	// the sub-tasks are listed with their paths
+	const auto &tree = mList->getTree();
+	auto taskList = tree.getFiltered(mFilter);
+	tree.sortByActivity(taskList);
+	for (auto *node : taskList) {
+		std::string id = std::string(" #") + node->path;
+		std::cout << std::setw(4) << id << " " << node->task->getName() << "\n";
+	}
+
+}
+
+void TaskListView::showHistory(CliInterface *parent, std::vector<std::string> &args)
+{
+	if(args.size() != 1) {
+		std::cout << "USAGE: history #ID\n";
+		return;
+	}
+	std::string id = args[0];
+	if(!id.empty() && id[0] == '#') {
+		id = id.substr(1);
+	}
+	auto changes = parent->getProject()->getTaskHistory(atoi(id.c_str()));
+	if(changes.empty()) {
+		std::cout << "No history for task #" << id << ".\n";
+	}
+	for(const auto &change : changes) {
+		std::cout << change.date.getFormattedTime("%Y-%m-%d %H:%M") << " "
+			<< change.commit.substr(0, 7) << " " << change.field;
+		if(!change.before.empty() || !change.after.empty()) {
+			std::cout << ": " << trim(change.before) << " -> " << trim(change.after);
+		}
+		std::cout << "\n";
+	}
+}
+
+// Lists the tasks that changed between the revisions
+void TaskListView::showDiff(CliInterface *parent, std::vector<std::string> &args)
+{
+	if(args.size() != 2) {
+		std::cout << "USAGE: diff REVISION REVISION\n";
+		return;
+	}
+	checkWrite(true);
+	std::vector<Backend::TaskDiff> diffs;
+	try {
+		diffs = parent->getProject()->diff(args[0], args[1]);
+	} catch(const char *e) {
+		std::cout << e << ".\n";
+		return;
+	}
+	for(const auto &diff : diffs) {
+		const char *mark = diff.kind == Backend::TaskDiff::ADDED ? "+"
+			: diff.kind == Backend::TaskDiff::REMOVED ? "-" : "~";
+		std::string id = std::string(" #") + std::to_string(diff.id);
+		std::cout << mark << std::setw(4) << id << " " << diff.name;
+		std::string separator = ": ";
+		for(const auto &field : diff.fields) {
+			std::cout << separator << field;
+			separator = ", ";
+		}
+		for(const auto &event : diff.events) {
+			std::cout << separator << "new " << event;
+			separator = ", ";
+		}
+		std::cout << "\n";
+	}
+}
 
-	auto taskList = mList->getFiltered(mFilter);
-	std::sort(taskList.begin(), taskList.end(), sort);
-	for (Backend::Task *t : taskList) {
-		std::string id = std::string(" #") + std::to_string(t->getId());
-		std::cout << std::setw(4) << id << " " << t->getName() << "\n";
+// Lists the tasks as they were at the date
+void TaskListView::showAt(CliInterface *parent, std::vector<std::string> &args)
+{
+	if(args.size() != 2 || args[0] != "--at") {
+		std::cout << "USAGE: show --at YYYY-MM-DD[THH:MM:SSZ]\n";
+		return;
+	}
+	auto *project = Backend::Project::openAt(parent->getProject()->getDirname(), Backend::Date(args[1]));
+	if(!project) {
+		std::cout << "No tasks at " << args[1] << ".\n";
+		return;
 	}
+	for(Backend::Task *task : project->getTaskList()->all()) {
+		std::string id = std::string(" #") + std::to_string(task->getId());
+		std::cout << std::setw(4) << id << " " << task->getName() << "\n";
+	}
+	delete project;
+}
 
+// Reports the result of the background write when it's done
+void TaskListView::checkWrite(bool wait)
+{
+	if(!mWrite.valid()) {
+		return;
+	}
+	if(!wait && mWrite.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+		return;
+	}
+	try {
+		mWrite.get();
+	} catch(std::exception &e) {
+		std::cerr << "Write failed: " << e.what() << "\n";
+	} catch(...) {
+		std::cerr << "Write failed.\n";
+	}
 }
 
 void TaskListView::render(CliInterface *parent)
@@ -356,6 +445,8 @@ void TaskListView::render(CliInterface *parent)
 	std::string command;
 	std::vector<std::string> args;
 
+	checkWrite(false);
+
 	if(mShowView) {
 		view(parent);
 		mShowView = false;
@@ -364,11 +455,11 @@ void TaskListView::render(CliInterface *parent)
 	Main::readline("TaskList>", command, args);
 
 	if (command == "o" || command == "open") {
-		int taskIndex;
-		std::istringstream iss(args[0]);
-		iss >> taskIndex;
-
-		Backend::Task *task = mList->getTask(taskIndex);
+		if (args.empty()) {
+			std::cout << "USAGE: open #ID[.SUB-ID...]\n";
+			return;
+		}
+		Backend::Task *task = mList->findTask(args[0]);
 		if (!task) {
 			std::cerr << "Task index is out-of-bounds.\n";
 			return;
@@ -400,8 +491,50 @@ void TaskListView::render(CliInterface *parent)
 		}
 		parent->newView(new ModifyTaskTypeView(args[0]));
 	} else if (command == "w" || command == "write") {
-		parent->getProject()->write();
+		checkWrite(true);
+		mWrite = parent->getProject()->writeAsync();
+	} else if (command == "h" || command == "history") {
+		showHistory(parent, args);
+	} else if (command == "show") {
+		showAt(parent, args);
+	} else if (command == "diff") {
+		showDiff(parent, args);
+	} else if (command == "gc" || command == "maintenance") {
+		checkWrite(true);
+		Backend::MaintenanceReport report;
+		try {
+			report = parent->getProject()->maintain();
+		} catch(std::exception &e) {
+			std::cerr << "Maintenance failed: " << e.what() << "\n";
+			return;
+		} catch(...) {
+			std::cerr << "Maintenance failed.\n";
+			return;
+		}
+		std::cout << "Packed " << report.packed << " objects.\n";
+		std::cout << "Loose objects: " << report.looseBefore << " -> " << report.looseAfter << "\n";
+		std::cout << std::fixed << std::setprecision(2);
+		std::cout << "Open time: " << report.openMsBefore << " ms -> " << report.openMsAfter << " ms\n";
+	} else if (command == "pull") {
+		if (args.size() != 1) {
+			std::cout << "USAGE: pull URL\n";
+			return;
+		}
+		checkWrite(true);
+		auto stats = parent->getProject()->pull(args[0]);
+		std::cout << "Merged " << stats.tasksMerged << " tasks, "
+			<< stats.conflicts << " conflicts, "
+			<< stats.tasksRenumbered << " renumbered.\n";
+		mShowView = true;
+	} else if (command == "push") {
+		if (args.size() != 1) {
+			std::cout << "USAGE: push URL\n";
+			return;
+		}
+		checkWrite(true);
+		parent->getProject()->push(args[0]);
 	} else if (command == "q" || command == "quit") {
+		checkWrite(true);
 		parent->deleteView(this);
 	} else {
 		std::cerr << "Unknown command '" << command << "'.\n";
@@ -525,20 +658,26 @@ void TaskView::view(CliInterface *parent)
 	}
 
 	for(auto *event : mTask->getEvents()) {
-		auto *comment = dynamic_cast<Backend::CommentEvent*>(event);
-		auto *stateChange = dynamic_cast<Backend::StateChangeEvent*>(event);
-
 		std::ostringstream header;
 		header << event->getCreationDate().getFormattedTime("%d.%m.%Y")
 		          << " by " << event->getUser()->getName() << "\n";
 		std::cout << parent->getText(EVENT_HEADER, header.str());
-		if(comment) {
-			std::cout << comment->getContent();
-		} else if(stateChange) {
-			std::cout << "State changed from " << stateChange->from()->getName()
-			          << " to " << stateChange->to()->getName() << "\n";
-		} else {
-			std::cout << "Unknown event\n";
+		switch(event->getKind()) {
+			case Backend::TaskEvent::COMMENT:
+				std::cout << event->as<Backend::CommentEvent>()->getContent();
+				break;
+			case Backend::TaskEvent::STATE_CHANGE: {
+				auto *stateChange = event->as<Backend::StateChangeEvent>();
+				std::cout << "State changed from " << stateChange->from()->getName()
+				          << " to " << stateChange->to()->getName() << "\n";
+				break;
+			}
+			case Backend::TaskEvent::COMMIT_REF:
+				std::cout << "Referenced in commit "
+				          << event->as<Backend::CommitEvent>()->getCommit().substr(0, 7) << "\n";
+				break;
+			default:
+				std::cout << "Unknown event\n";
 		}
 		std::cout << "\n";
 	}
@@ -74,8 +74,14 @@ public:
 	void render(CliInterface *parent) override;
 	void view(CliInterface *parent);
 private:
+	void checkWrite(bool wait);
+	void showHistory(CliInterface *parent, std::vector<std::string> &args);
+	void showAt(CliInterface *parent, std::vector<std::string> &args);
+	void showDiff(CliInterface *parent, std::vector<std::string> &args);
+
 	Backend::TaskFilter *mFilter;
 	bool mShowView;
+	std::future<void> mWrite;
 };
 
 class Main : public CliInterface
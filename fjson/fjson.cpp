@@ -20,6 +20,7 @@
 #include <algorithm>
 #include <sstream>
 #include <string.h>
+#include <cstdio>
 #include "fjson.h"
 
 namespace FJson {
@@ -156,22 +157,22 @@ void IstreamTokenStream::parseNumber()
 	}
 }
 
-void IstreamTokenStream::generateUtf8(std::ostream &builder, int value)
+void IstreamTokenStream::generateUtf8(std::string &builder, int value)
 {
 	if(value < 0x80) {
-		builder << (char)value;
+		builder += (char)value;
 	} else if(value < 0x800) {
-		builder << (char)(0xc0 | (value >> 6 & 0x1f));
-		builder << (char)(0x80 | (value & 0x3f));
+		builder += (char)(0xc0 | (value >> 6 & 0x1f));
+		builder += (char)(0x80 | (value & 0x3f));
 	} else if(value < 0x10000) {
-		builder << (char)(0xe0 | (value >> 12 & 0x0f));
-		builder << (char)(0x80 | (value >> 6 & 0x3f));
-		builder << (char)(0x80 | (value & 0x3f));
+		builder += (char)(0xe0 | (value >> 12 & 0x0f));
+		builder += (char)(0x80 | (value >> 6 & 0x3f));
+		builder += (char)(0x80 | (value & 0x3f));
 	} else if(value < 0x110000) {
-		builder << (char)(0xf0 | (value >> 18 & 0x07));
-		builder << (char)(0x80 | (value >> 12 & 0x3f));
-		builder << (char)(0x80 | (value >> 6 & 0x3f));
-		builder << (char)(0x80 | (value & 0x3f));
+		builder += (char)(0xf0 | (value >> 18 & 0x07));
+		builder += (char)(0x80 | (value >> 12 & 0x3f));
+		builder += (char)(0x80 | (value >> 6 & 0x3f));
+		builder += (char)(0x80 | (value & 0x3f));
 	} else {
 		throw Exception("Invalid unicode character.");
 	}
@@ -184,7 +185,10 @@ void IstreamTokenStream::parseString()
 		throw Exception("expected '\"'(quote).");
 	}
 
-	std::ostringstream builder;
+	// the string of the token is reused so it is usually already large
+	// enough
+	std::string &builder = mToken->string;
+	builder.clear();
 	c = mStream.get();
 	while(c != '\"' && c != -1) {
 		//TODO we should validate utf8 multi-byte characters
@@ -223,16 +227,14 @@ void IstreamTokenStream::parseString()
 			}
 
 			if(c != -1) {
-				builder << (char)c;
+				builder += (char)c;
 			}
 		} else {
-			builder << (char)c;
+			builder += (char)c;
 		}
 		c = mStream.get();
 	}
 
-	mToken->string = builder.str();
-
 	if(c != '\"') {
 		throw Exception("expected '\"'(quote).");
 	}
@@ -332,6 +334,20 @@ void TokenCache::next(Token *token)
 	mIndex++;
 }
 
+// Adds an object member in the same form as skipValue() records the
+// foreign keys
+void TokenCache::recordKey(const std::string &key, const TokenCache &value)
+{
+	Token separator(SEPARATOR);
+	record(separator);
+	Token name(STRING);
+	name.string = key;
+	record(name);
+	Token colon(COLON);
+	record(colon);
+	mTokens.insert(mTokens.end(), value.mTokens.begin(), value.mTokens.end());
+}
+
 std::vector<Token> TokenCache::getTokens() const
 {
 	return mTokens;
@@ -447,6 +463,33 @@ void Reader::read(std::string &value)
 	tokenize();
 }
 
+void Reader::read(const std::string *&value, Interner &interner)
+{
+	if(mToken.type == STRING) {
+		value = interner.intern(mToken.string);
+	} else if(mToken.type == NUL) {
+		value = interner.intern("");
+	} else {
+		throw Exception("Expected string.");
+	}
+	tokenize();
+}
+
+// Reads an array of strings as one text, used for the line arrays that
+// are written with Writer::writeLines()
+void Reader::readLines(std::string &text)
+{
+	startArray();
+	while(hasNextElement()) {
+		if(mToken.type == STRING) {
+			text.append(mToken.string);
+		} else if(mToken.type != NUL) {
+			throw Exception("Expected string.");
+		}
+		tokenize();
+	}
+}
+
 void Reader::skipValue(TokenCache *cache, bool isForeignKey)
 {
 	std::string key;
@@ -641,12 +684,15 @@ const std::map<std::string, TokenCache*> AssocArray::getValues()
 
 /// Writer
 
-Writer::Writer(std::ostream &stream, bool doPretty)
+// The depth is used when the output is a fragment that is later placed
+// inside a bigger document, so that the indentation matches.
+Writer::Writer(std::ostream &stream, bool doPretty, unsigned int depth)
 	:mStream(stream)
 {
 	mState = S_INIT;
 	mDoPrettyPrint = doPretty;
 	mIndentWidth = 1;
+	mBaseDepth = depth;
 	mIndentChar = '\t';
 }
 
@@ -724,6 +770,80 @@ void Writer::write(const TokenCache &cache)
 	}
 }
 
+// Writes the text as an array of lines, every line ends with a line
+// feed. The lines are escaped straight from the text without copying.
+void Writer::writeLines(const std::string &text)
+{
+	startArray();
+	const char *line = text.data();
+	const char *end = line + text.size();
+	while(line < end) {
+		const char *lineEnd = (const char*)memchr(line, '\n', end - line);
+		if(!lineEnd) {
+			lineEnd = end;
+		}
+		startNextElement();
+		valueStateTransition();
+		mStream.put('"');
+		writeEscaped(line, lineEnd - line);
+		mStream.write("\\n\"", 3);
+		line = lineEnd + 1;
+	}
+	endArray();
+}
+
+// Writes the characters that don't need escaping as whole runs
+void Writer::writeEscaped(const char *str, size_t length)
+{
+	size_t run = 0;
+	for(size_t i = 0; i < length; i++) {
+		unsigned char c = str[i];
+		if(c >= 0x20 && c != '"' && c != '\\') {
+			continue;
+		}
+		mStream.write(str + run, i - run);
+		run = i + 1;
+		switch(c) {
+		case '"':
+			mStream.write("\\\"", 2);
+			break;
+		case '\\':
+			mStream.write("\\\\", 2);
+			break;
+		case '\n':
+			mStream.write("\\n", 2);
+			break;
+		case '\r':
+			mStream.write("\\r", 2);
+			break;
+		case '\t':
+			mStream.write("\\t", 2);
+			break;
+		case '\b':
+			mStream.write("\\b", 2);
+			break;
+		case '\f':
+			mStream.write("\\f", 2);
+			break;
+		default: {
+			char buf[7];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			mStream.write(buf, 6);
+			break;
+		}
+		}
+	}
+	mStream.write(str + run, length - run);
+}
+
+// Writes already serialized json value as is, the caller must make sure
+// that it was written with the same indentation depth.
+void Writer::writeRaw(const std::string &json)
+{
+	valueStateTransition();
+	mStream << json;
+}
+
 void Writer::startObject()
 {
 	if(mState == S_VALUE) throw ApiException("bad state");
@@ -738,7 +858,7 @@ void Writer::endObject()
 	Token t(END_OBJECT);
 	writeToken(&t);
 
-	if(mStack.empty()) {
+	if(mStack.empty() && !mBaseDepth) {
 		Token t(END);
 		writeToken(&t);
 	}
@@ -775,7 +895,7 @@ void Writer::endArray()
 	Token t(END_ARRAY);
 	writeToken(&t);
 
-	if(mStack.empty()) {
+	if(mStack.empty() && !mBaseDepth) {
 		Token t(END);
 		writeToken(&t);
 	}
@@ -797,7 +917,7 @@ void Writer::writeToken(Token *token)
 	switch(token->type) {
 		case STRING:
 			mStream.put('"');
-			mStream << token->string;
+			writeEscaped(token->string.data(), token->string.size());
 			mStream.put('"');
 			break;
 		case BOOLEAN:
@@ -869,7 +989,7 @@ void Writer::doIndentation(bool lineFeed) const
 	if(lineFeed) {
 		mStream << "\n";
 	}
-	mStream << std::string(mStack.size() * mIndentWidth, mIndentChar);
+	mStream << std::string((mBaseDepth + mStack.size()) * mIndentWidth, mIndentChar);
 }
 
 };
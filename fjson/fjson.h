@@ -60,13 +60,14 @@ private:
 	double fast10pow(long exp);
 	void parseNumber();
 	void parseString();
-	void generateUtf8(std::ostream &builder, int value);
+	void generateUtf8(std::string &builder, int value);
 };
 
 class TokenCache : public TokenStream {
 public:
 	TokenCache();
 	void record(Token &token);
+	void recordKey(const std::string &key, const TokenCache &value);
 	void next(Token *token) override;
 	bool isCache() override {return true;};
 	void dump() const;
@@ -76,6 +77,14 @@ private:
 	unsigned int mIndex;
 };
 
+// Returns the single copy of the string. The strings read with an
+// interner are not copied if they are already interned.
+class Interner {
+public:
+	virtual ~Interner() {};
+	virtual const std::string *intern(const std::string &string) = 0;
+};
+
 class Reader {
 public:
 	Reader(std::istream &stream);
@@ -88,6 +97,8 @@ public:
 	void read(float &value);
 	void read(double &value);
 	void read(std::string &value);
+	void read(const std::string *&value, Interner &interner);
+	void readLines(std::string &text);
 	void skipValue(TokenCache *cache = NULL, bool isForeignKey = false);
 
 	void startObject();
@@ -125,7 +136,7 @@ private:
 
 class Writer {
 public:
-	Writer(std::ostream &stream, bool doPretty = false);
+	Writer(std::ostream &stream, bool doPretty = false, unsigned int depth = 0);
 	~Writer();
 
 	void write(void *value);
@@ -136,6 +147,8 @@ public:
 	void write(double value);
 	void write(std::string value);
 	void write(const TokenCache &cache);
+	void writeRaw(const std::string &json);
+	void writeLines(const std::string &text);
 
 	void startObject();
 	void endObject();
@@ -148,9 +161,11 @@ private:
 	void doIndentation(bool lineFeed = false) const;
 	void valueStateTransition();
 	void writeToken(Token *token);
+	void writeEscaped(const char *str, size_t length);
 
 	bool mDoPrettyPrint;
 	unsigned int mIndentWidth;
+	unsigned int mBaseDepth;
 	std::vector<char> mStack;
 	char mIndentChar;
 	State mState;
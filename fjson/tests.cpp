@@ -457,6 +457,31 @@ static bool writeObject()
 	return res;
 }
 
+static bool writeFragment()
+{
+	bool res = true;
+
+	std::ostringstream fragment;
+	Writer *fragmentOut = new Writer(fragment, true, 1);
+	fragmentOut->startObject();
+	fragmentOut->writeObjectKey("test");
+	fragmentOut->write(4);
+	fragmentOut->endObject();
+	delete fragmentOut;
+	res &= fragment.str() == "{\n\t\t\"test\": 4\n\t}";
+
+	createWriter(true);
+	out->startArray();
+	out->startNextElement();
+	out->writeRaw(fragment.str());
+	out->startNextElement();
+	out->write(1);
+	out->endArray();
+	res &= ostream.str() == "[\n\t{\n\t\t\"test\": 4\n\t},\n\t1\n]\n";
+
+	return res;
+}
+
 static bool badWriteMixed()
 {
 	bool res = true;
@@ -643,6 +668,8 @@ int main(int argc, char **argv)
 	std::cout << (success ? "Success" : "Failure") << "\n";
 	success = writeObject();
 	std::cout << (success ? "Success" : "Failure") << "\n";
+	success = writeFragment();
+	std::cout << (success ? "Success" : "Failure") << "\n";
 	success = badWriteMixed();
 	std::cout << (success ? "Success" : "Failure") << "\n";
 
@@ -20,13 +20,24 @@
 
 #include <string>
 #include <cstring>
+#include <fstream>
+#include <chrono>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <git2/sys/refdb_backend.h>
+#include <git2/sys/refs.h>
+#include <git2/sys/repository.h>
 #include "git.h"
 
 namespace Tasker {
 namespace Backend {
 
 int GitBackend::refs_to_lib = 0;
+std::mutex GitBackend::lib_mutex;
 
 GitException::GitException(std::string &source) {
 	mMessage = getMessage(source);
@@ -39,12 +50,396 @@ GitException::GitException(const char *source) {
 
 const char *GitException::getMessage(std::string &source) {
 	const git_error *error = giterr_last();
+	if(!error) {
+		// the error didn't come from libgit2
+		return strdup(source.c_str());
+	}
 	return strdup((source + ": " + error->message).c_str());
 }
 
+static std::string oidKey(const git_oid *oid)
+{
+	return std::string((const char*)oid->id, sizeof(oid->id));
+}
+
+// Object and reference databases that keep everything in memory. They
+// are used by the repositories that are never written to the disk.
+
+struct MemoryOdb {
+	git_odb_backend parent;
+	struct Object {
+		git_object_t type;
+		std::string data;
+	};
+	std::map<std::string, Object> objects;
+};
+
+static bool matchesPrefix(const std::string &key, const git_oid *prefix, size_t length)
+{
+	for(size_t i = 0; i < length; i++) {
+		unsigned char a = key[i / 2], b = prefix->id[i / 2];
+		if(i % 2 == 0) {
+			a >>= 4;
+			b >>= 4;
+		}
+		if((a & 0xf) != (b & 0xf)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Finds the only object whose id starts with the length hex digits of the prefix
+static int memoryOdbFind(MemoryOdb *odb, const git_oid *prefix, size_t length, git_oid *found)
+{
+	int matches = 0;
+	for(const auto &object : odb->objects) {
+		if(matchesPrefix(object.first, prefix, length)) {
+			memcpy(found->id, object.first.data(), sizeof(found->id));
+			matches++;
+		}
+	}
+	if(matches == 0) {
+		return GIT_ENOTFOUND;
+	}
+	return matches == 1 ? 0 : GIT_EAMBIGUOUS;
+}
+
+static int memoryOdbRead(void **data, size_t *size, git_object_t *type, git_odb_backend *backend, const git_oid *oid)
+{
+	auto *odb = (MemoryOdb*)backend;
+	auto iter = odb->objects.find(oidKey(oid));
+	if(iter == odb->objects.end()) {
+		return GIT_ENOTFOUND;
+	}
+	const std::string &content = iter->second.data;
+	*data = git_odb_backend_data_alloc(backend, content.size() + 1);
+	if(!*data) {
+		return GIT_ERROR;
+	}
+	memcpy(*data, content.data(), content.size());
+	*size = content.size();
+	*type = iter->second.type;
+	return 0;
+}
+
+static int memoryOdbReadPrefix(git_oid *out, void **data, size_t *size, git_object_t *type,
+	git_odb_backend *backend, const git_oid *prefix, size_t length)
+{
+	int ret = memoryOdbFind((MemoryOdb*)backend, prefix, length, out);
+	if(ret) {
+		return ret;
+	}
+	return memoryOdbRead(data, size, type, backend, out);
+}
+
+static int memoryOdbReadHeader(size_t *size, git_object_t *type, git_odb_backend *backend, const git_oid *oid)
+{
+	auto *odb = (MemoryOdb*)backend;
+	auto iter = odb->objects.find(oidKey(oid));
+	if(iter == odb->objects.end()) {
+		return GIT_ENOTFOUND;
+	}
+	*size = iter->second.data.size();
+	*type = iter->second.type;
+	return 0;
+}
+
+static int memoryOdbWrite(git_odb_backend *backend, const git_oid *oid, const void *data, size_t size, git_object_t type)
+{
+	auto *odb = (MemoryOdb*)backend;
+	auto &object = odb->objects[oidKey(oid)];
+	object.type = type;
+	object.data.assign((const char*)data, size);
+	return 0;
+}
+
+static int memoryOdbExists(git_odb_backend *backend, const git_oid *oid)
+{
+	auto *odb = (MemoryOdb*)backend;
+	return odb->objects.count(oidKey(oid)) ? 1 : 0;
+}
+
+static int memoryOdbExistsPrefix(git_oid *out, git_odb_backend *backend, const git_oid *prefix, size_t length)
+{
+	return memoryOdbFind((MemoryOdb*)backend, prefix, length, out);
+}
+
+static int memoryOdbForeach(git_odb_backend *backend, git_odb_foreach_cb callback, void *payload)
+{
+	auto *odb = (MemoryOdb*)backend;
+	for(const auto &object : odb->objects) {
+		git_oid oid;
+		memcpy(oid.id, object.first.data(), sizeof(oid.id));
+		int ret = callback(&oid, payload);
+		if(ret) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static void memoryOdbFree(git_odb_backend *backend)
+{
+	delete (MemoryOdb*)backend;
+}
+
+static git_odb_backend *newMemoryOdb()
+{
+	auto *odb = new MemoryOdb();
+	git_odb_init_backend(&odb->parent, GIT_ODB_BACKEND_VERSION);
+	odb->parent.read = memoryOdbRead;
+	odb->parent.read_prefix = memoryOdbReadPrefix;
+	odb->parent.read_header = memoryOdbReadHeader;
+	odb->parent.write = memoryOdbWrite;
+	odb->parent.exists = memoryOdbExists;
+	odb->parent.exists_prefix = memoryOdbExistsPrefix;
+	odb->parent.foreach = memoryOdbForeach;
+	odb->parent.free = memoryOdbFree;
+	return &odb->parent;
+}
+
+struct MemoryRefdb {
+	git_refdb_backend parent;
+	// the target is set for symbolic references
+	struct Ref {
+		git_oid oid;
+		std::string target;
+	};
+	std::map<std::string, Ref> refs;
+};
+
+struct MemoryRefIterator {
+	git_reference_iterator parent;
+	std::vector<std::pair<std::string, MemoryRefdb::Ref> > refs;
+	size_t next;
+};
+
+static git_reference *allocReference(const std::string &name, const MemoryRefdb::Ref &ref)
+{
+	if(!ref.target.empty()) {
+		return git_reference__alloc_symbolic(name.c_str(), ref.target.c_str());
+	}
+	return git_reference__alloc(name.c_str(), &ref.oid, NULL);
+}
+
+static int memoryRefdbExists(int *exists, git_refdb_backend *backend, const char *name)
+{
+	auto *refdb = (MemoryRefdb*)backend;
+	*exists = refdb->refs.count(name) ? 1 : 0;
+	return 0;
+}
+
+static int memoryRefdbLookup(git_reference **out, git_refdb_backend *backend, const char *name)
+{
+	auto *refdb = (MemoryRefdb*)backend;
+	auto iter = refdb->refs.find(name);
+	if(iter == refdb->refs.end()) {
+		return GIT_ENOTFOUND;
+	}
+	*out = allocReference(iter->first, iter->second);
+	return *out ? 0 : GIT_ERROR;
+}
+
+static int memoryRefIteratorNext(git_reference **out, git_reference_iterator *iterator)
+{
+	auto *iter = (MemoryRefIterator*)iterator;
+	if(iter->next >= iter->refs.size()) {
+		return GIT_ITEROVER;
+	}
+	const auto &ref = iter->refs[iter->next++];
+	*out = allocReference(ref.first, ref.second);
+	return *out ? 0 : GIT_ERROR;
+}
+
+static int memoryRefIteratorNextName(const char **out, git_reference_iterator *iterator)
+{
+	auto *iter = (MemoryRefIterator*)iterator;
+	if(iter->next >= iter->refs.size()) {
+		return GIT_ITEROVER;
+	}
+	*out = iter->refs[iter->next++].first.c_str();
+	return 0;
+}
+
+static void memoryRefIteratorFree(git_reference_iterator *iterator)
+{
+	delete (MemoryRefIterator*)iterator;
+}
+
+static int memoryRefdbIterator(git_reference_iterator **out, git_refdb_backend *backend, const char *glob)
+{
+	auto *refdb = (MemoryRefdb*)backend;
+	auto *iter = new MemoryRefIterator();
+	iter->next = 0;
+	iter->parent.next = memoryRefIteratorNext;
+	iter->parent.next_name = memoryRefIteratorNextName;
+	iter->parent.free = memoryRefIteratorFree;
+	for(const auto &ref : refdb->refs) {
+		if(ref.first == "HEAD") continue;
+		if(!glob || !fnmatch(glob, ref.first.c_str(), 0)) {
+			iter->refs.push_back(ref);
+		}
+	}
+	*out = &iter->parent;
+	return 0;
+}
+
+// Checks that the reference still has the value the caller expects
+static bool memoryRefdbMatches(MemoryRefdb *refdb, const char *name, const git_oid *oldId, const char *oldTarget)
+{
+	auto iter = refdb->refs.find(name);
+	if(oldId && (iter == refdb->refs.end() || !iter->second.target.empty()
+		|| git_oid_cmp(oldId, &iter->second.oid))) {
+		return false;
+	}
+	if(oldTarget && (iter == refdb->refs.end() || iter->second.target != oldTarget)) {
+		return false;
+	}
+	return true;
+}
+
+static int memoryRefdbWrite(git_refdb_backend *backend, const git_reference *ref, int force,
+	const git_signature *who, const char *message, const git_oid *oldId, const char *oldTarget)
+{
+	auto *refdb = (MemoryRefdb*)backend;
+	std::string name = git_reference_name(ref);
+	if(!force && refdb->refs.count(name)) {
+		return GIT_EEXISTS;
+	}
+	if(!memoryRefdbMatches(refdb, name.c_str(), oldId, oldTarget)) {
+		return GIT_EMODIFIED;
+	}
+
+	MemoryRefdb::Ref value = MemoryRefdb::Ref();
+	if(git_reference_type(ref) == GIT_REFERENCE_SYMBOLIC) {
+		value.target = git_reference_symbolic_target(ref);
+	} else {
+		value.oid = *git_reference_target(ref);
+	}
+	refdb->refs[name] = value;
+	return 0;
+}
+
+static int memoryRefdbRename(git_reference **out, git_refdb_backend *backend, const char *oldName,
+	const char *newName, int force, const git_signature *who, const char *message)
+{
+	auto *refdb = (MemoryRefdb*)backend;
+	auto iter = refdb->refs.find(oldName);
+	if(iter == refdb->refs.end()) {
+		return GIT_ENOTFOUND;
+	}
+	if(!force && refdb->refs.count(newName)) {
+		return GIT_EEXISTS;
+	}
+	MemoryRefdb::Ref value = iter->second;
+	refdb->refs.erase(iter);
+	refdb->refs[newName] = value;
+	*out = allocReference(newName, value);
+	return *out ? 0 : GIT_ERROR;
+}
+
+static int memoryRefdbDelete(git_refdb_backend *backend, const char *name, const git_oid *oldId, const char *oldTarget)
+{
+	auto *refdb = (MemoryRefdb*)backend;
+	if(!refdb->refs.count(name)) {
+		return GIT_ENOTFOUND;
+	}
+	if(!memoryRefdbMatches(refdb, name, oldId, oldTarget)) {
+		return GIT_EMODIFIED;
+	}
+	refdb->refs.erase(name);
+	return 0;
+}
+
+// there are no reflogs in memory
+static int memoryRefdbCompress(git_refdb_backend *backend)
+{
+	return 0;
+}
+
+static int memoryRefdbHasLog(git_refdb_backend *backend, const char *name)
+{
+	return 0;
+}
+
+static int memoryRefdbEnsureLog(git_refdb_backend *backend, const char *name)
+{
+	return 0;
+}
+
+static int memoryRefdbReflogRead(git_reflog **out, git_refdb_backend *backend, const char *name)
+{
+	return GIT_ENOTFOUND;
+}
+
+static int memoryRefdbReflogWrite(git_refdb_backend *backend, git_reflog *reflog)
+{
+	return 0;
+}
+
+static int memoryRefdbReflogRename(git_refdb_backend *backend, const char *oldName, const char *newName)
+{
+	return 0;
+}
+
+static int memoryRefdbReflogDelete(git_refdb_backend *backend, const char *name)
+{
+	return 0;
+}
+
+static int memoryRefdbLock(void **payload, git_refdb_backend *backend, const char *name)
+{
+	return GIT_ERROR;
+}
+
+static int memoryRefdbUnlock(git_refdb_backend *backend, void *payload, int success, int updateReflog,
+	const git_reference *ref, const git_signature *sig, const char *message)
+{
+	return GIT_ERROR;
+}
+
+static void memoryRefdbFree(git_refdb_backend *backend)
+{
+	delete (MemoryRefdb*)backend;
+}
+
+static git_refdb_backend *newMemoryRefdb()
+{
+	auto *refdb = new MemoryRefdb();
+	git_refdb_init_backend(&refdb->parent, GIT_REFDB_BACKEND_VERSION);
+	refdb->parent.exists = memoryRefdbExists;
+	refdb->parent.lookup = memoryRefdbLookup;
+	refdb->parent.iterator = memoryRefdbIterator;
+	refdb->parent.write = memoryRefdbWrite;
+	refdb->parent.rename = memoryRefdbRename;
+	refdb->parent.del = memoryRefdbDelete;
+	refdb->parent.compress = memoryRefdbCompress;
+	refdb->parent.has_log = memoryRefdbHasLog;
+	refdb->parent.ensure_log = memoryRefdbEnsureLog;
+	refdb->parent.free = memoryRefdbFree;
+	refdb->parent.reflog_read = memoryRefdbReflogRead;
+	refdb->parent.reflog_write = memoryRefdbReflogWrite;
+	refdb->parent.reflog_rename = memoryRefdbReflogRename;
+	refdb->parent.reflog_delete = memoryRefdbReflogDelete;
+	refdb->parent.lock = memoryRefdbLock;
+	refdb->parent.unlock = memoryRefdbUnlock;
+
+	MemoryRefdb::Ref head = MemoryRefdb::Ref();
+	head.target = "refs/heads/master";
+	refdb->refs["HEAD"] = head;
+	return &refdb->parent;
+}
+
+// same as the default of git's gc.auto
+static const unsigned int DEFAULT_AUTO_MAINTENANCE = 6700;
+// the blob cache is dropped when the cached contents grow over this
+static const size_t MAX_BLOB_CACHE_SIZE = 16 * 1024 * 1024;
+
 GitBackend::GitBackend()
-	:mRepo(NULL), mTreeBuilder(NULL)
+	:mTreeBuilder(NULL), mAutoMaintenance(DEFAULT_AUTO_MAINTENANCE), mBlobCacheSize(0)
 {
+	std::lock_guard<std::mutex> lock(lib_mutex);
 	if(GitBackend::refs_to_lib == 0) {
 		git_libgit2_init();
 	}
@@ -56,9 +451,17 @@ GitBackend::~GitBackend()
 	if(mTreeBuilder) {
 		git_treebuilder_free(mTreeBuilder);
 	}
-	if(mRepo) {
-		git_repository_free(mRepo);
+	clearHead(&mMain);
+	if(mMain.repo) {
+		git_repository_free(mMain.repo);
+	}
+	for(Handle *handle : mHandles) {
+		clearHead(handle);
+		git_repository_free(handle->repo);
+		delete handle;
 	}
+
+	std::lock_guard<std::mutex> lock(lib_mutex);
 	GitBackend::refs_to_lib--;
 	if(GitBackend::refs_to_lib == 0) {
 		git_libgit2_shutdown();
@@ -70,12 +473,13 @@ GitBackend *GitBackend::open(std::string path)
 	GitBackend *backend = new GitBackend();
 	//git_repository_open_bare ?
 	int ret;
-	if((ret = git_repository_open(&backend->mRepo, path.c_str()))) {
+	if((ret = git_repository_open(&backend->mMain.repo, path.c_str()))) {
 		if(ret == GIT_ENOTFOUND) {
 			return NULL;
 		}
 		throw GitException("Repo open failed");
 	}
+	backend->mPath = git_repository_path(backend->mMain.repo);
 	return backend;
 }
 
@@ -84,10 +488,78 @@ GitBackend *GitBackend::create(std::string path)
 	GitBackend *backend = new GitBackend();
 	bool is_bare = false;//no working dir
 	//git_repository_init_init_options ?
-	if(git_repository_init(&backend->mRepo, path.c_str(), is_bare)) {
+	if(git_repository_init(&backend->mMain.repo, path.c_str(), is_bare)) {
+		throw GitException("Repo init failed");
+	}
+	backend->mPath = git_repository_path(backend->mMain.repo);
+	if(git_treebuilder_new(&backend->mTreeBuilder, backend->mMain.repo, NULL)) {
+		throw GitException("Failed to create initial tree for repo");
+	}
+	backend->commit();
+	return backend;
+}
+
+// The directory of the repository, empty for in-memory repositories
+std::string GitBackend::getPath() const
+{
+	return mPath;
+}
+
+// Creates an empty bare repository that the projects are pushed to and
+// pulled from.
+GitBackend *GitBackend::createRemote(std::string path)
+{
+	GitBackend *backend = new GitBackend();
+	if(git_repository_init(&backend->mMain.repo, path.c_str(), true)) {
 		throw GitException("Repo init failed");
 	}
-	if(git_treebuilder_new(&backend->mTreeBuilder, backend->mRepo, NULL)) {
+	backend->mPath = git_repository_path(backend->mMain.repo);
+	return backend;
+}
+
+// Creates a repository that has the branch of the url as its HEAD
+GitBackend *GitBackend::clone(std::string url, std::string path)
+{
+	GitBackend *backend = new GitBackend();
+	if(git_repository_init(&backend->mMain.repo, path.c_str(), false)) {
+		throw GitException("Repo init failed");
+	}
+	backend->mPath = git_repository_path(backend->mMain.repo);
+	std::string head = backend->fetch(url);
+	if(head.empty()) {
+		delete backend;
+		throw "Nothing to clone";
+	}
+	backend->setHead(head);
+	return backend;
+}
+
+// Creates a repository that lives only in memory, nothing is written to
+// the disk. Meant for tests and benchmarks.
+GitBackend *GitBackend::createInMemory()
+{
+	GitBackend *backend = new GitBackend();
+	git_repository *repo;
+	if(git_repository_new(&repo)) {
+		throw GitException("Repo init failed");
+	}
+	backend->mMain.repo = repo;
+
+	git_odb *odb;
+	if(git_odb_new(&odb) || git_odb_add_backend(odb, newMemoryOdb(), 1)) {
+		throw GitException("Failed to create object database");
+	}
+	git_repository_set_odb(repo, odb);
+	git_odb_free(odb);
+
+	git_refdb *refdb;
+	if(git_refdb_new(&refdb, repo) || git_refdb_set_backend(refdb, newMemoryRefdb())) {
+		throw GitException("Failed to create reference database");
+	}
+	git_repository_set_refdb(repo, refdb);
+	git_refdb_free(refdb);
+
+	if(git_treebuilder_new(&backend->mTreeBuilder, repo, NULL)) {
 		throw GitException("Failed to create initial tree for repo");
 	}
 	backend->commit();
@@ -96,63 +568,246 @@ GitBackend *GitBackend::create(std::string path)
 
 GitFileBuffer *GitBackend::addFile(std::string file)
 {
+	std::lock_guard<std::mutex> lock(mWriteMutex);
 	if(!mTreeBuilder) {
-		int ret = git_treebuilder_new(&mTreeBuilder, mRepo, NULL);
-		if(ret) {
-			throw GitException("Failed to create tree builder");
-		}
+		startTree();
 	}
 
 	return new GitFileBuffer(this, file);
 }
 
-void GitBackend::commit()
+// Starts from the current tree so that the files which are not written
+// again keep their old blobs. mWriteMutex must be held.
+void GitBackend::startTree()
+{
+	git_tree *tree = getHeadTree(&mMain);
+	if(getHead(&mMain) && !tree) {
+		throw GitException("Failed to get the tree of HEAD");
+	}
+	if(git_treebuilder_new(&mTreeBuilder, mMain.repo, tree)) {
+		throw GitException("Failed to create tree builder");
+	}
+}
+
+// Commits the added files, the commits are numbered if there is no
+// message. The merge parent is the other parent of a merge commit.
+void GitBackend::commit(std::string message, std::string mergeParent)
 {
 	//TODO implement
 	git_oid oid, oid_tree;
 	git_tree *tree;
 	git_signature *author;
 
-	if(!mTreeBuilder) {
+	std::lock_guard<std::mutex> lock(mWriteMutex);
+	if(!mTreeBuilder && mergeParent.empty()) {
 		throw GitException("No changes");
+	} else if(!mTreeBuilder) {
+		// a merge that takes nothing from the other side keeps our tree
+		startTree();
 	}
 
 	if(git_treebuilder_write(&oid_tree, mTreeBuilder)) {
 		throw GitException("Write failed");
 	}
 
-	if(git_tree_lookup(&tree, mRepo, &oid_tree)) {
+	if(git_tree_lookup(&tree, mMain.repo, &oid_tree)) {
 		throw GitException("Tree lookup failed");
 	}
 
-	if(git_signature_default(&author, mRepo)) {
-		throw GitException("No default user");
+	if(git_signature_default(&author, mMain.repo)) {
+		// a repository in memory has no config of its own
+		if(!mPath.empty() || git_signature_now(&author, "tasker", "tasker@localhost")) {
+			throw GitException("No default user");
+		}
 	}
-	git_commit *head = getHead();
-	std::string msg = getNextCommitMessage(head);
-	if(git_commit_create(&oid, mRepo, "HEAD", author, author, "UTF-8",
-		msg.c_str(), tree, head ? 1 : 0, (const git_commit**)&head)) {
-		throw GitException("Failed to create commit");
+	git_commit *parents[2] = {getHead(&mMain), NULL};
+	size_t parentCount = parents[0] ? 1 : 0;
+	if(!mergeParent.empty()) {
+		git_oid parentId;
+		if(git_oid_fromstrn(&parentId, mergeParent.c_str(), mergeParent.size())
+			|| git_commit_lookup(&parents[parentCount], mMain.repo, &parentId)) {
+			throw GitException("Merged commit not found");
+		}
+		parentCount++;
+	}
+	std::string msg = message.empty() ? getNextCommitMessage(parents[0]) : message;
+	int ret = git_commit_create(&oid, mMain.repo, "HEAD", author, author, "UTF-8",
+		msg.c_str(), tree, parentCount, (const git_commit**)parents);
+	if(!mergeParent.empty()) {
+		git_commit_free(parents[parentCount - 1]);
 	}
-	git_commit_free(head);
 	git_signature_free(author);
-	git_tree_free(tree);
+	if(ret) {
+		throw GitException("Failed to create commit");
+	}
+
+	// the new commit becomes the cached HEAD
+	clearHead(&mMain);
+	if(git_commit_lookup(&mMain.head, mMain.repo, &oid)) {
+		mMain.head = NULL;
+		git_tree_free(tree);
+	} else {
+		mMain.headTree = tree;
+		mMain.headValid = true;
+		mMain.refStamp = getRefStamp();
+	}
 
 	git_treebuilder_free(mTreeBuilder);
 	mTreeBuilder = NULL;
+
+	if(mAutoMaintenance && estimateLooseObjects() > mAutoMaintenance) {
+		repack();
+	}
+}
+
+// Gives a repository handle for a reading thread. The handles are opened
+// on demand and reused, a repository without a path on disk can only be
+// used through the main handle.
+GitBackend::Handle *GitBackend::leaseHandle()
+{
+	if(mPath.empty()) {
+		mWriteMutex.lock();
+		return &mMain;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mHandleMutex);
+		if(!mFreeHandles.empty()) {
+			Handle *handle = mFreeHandles.back();
+			mFreeHandles.pop_back();
+			return handle;
+		}
+	}
+
+	Handle *handle = new Handle();
+	if(git_repository_open(&handle->repo, mPath.c_str())) {
+		delete handle;
+		throw GitException("Repo open failed");
+	}
+	std::lock_guard<std::mutex> lock(mHandleMutex);
+	mHandles.push_back(handle);
+	return handle;
 }
 
-git_commit *GitBackend::getHead()
+void GitBackend::releaseHandle(Handle *handle)
 {
+	if(handle == &mMain) {
+		mWriteMutex.unlock();
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mHandleMutex);
+	mFreeHandles.push_back(handle);
+}
+
+// Returns the HEAD commit which is owned by the handle. It is resolved
+// again only when the ref files have changed after the last lookup.
+git_commit *GitBackend::getHead(Handle *handle)
+{
+	std::string stamp = getRefStamp();
+	if(handle->headValid && stamp == handle->refStamp) {
+		return handle->head;
+	}
+	clearHead(handle);
+	handle->refStamp = stamp;
+	handle->headValid = true;
+
 	git_reference *ref;
-	if(git_repository_head(&ref, mRepo)) {
+	if(git_repository_head(&ref, handle->repo)) {
 		return NULL;
 	}
-	const git_oid *id = git_reference_target(ref);
-	git_commit *commit;
-	git_commit_lookup(&commit, mRepo, id);
+	if(git_commit_lookup(&handle->head, handle->repo, git_reference_target(ref))) {
+		handle->head = NULL;
+	}
 	git_reference_free(ref);
-	return commit;
+	return handle->head;
+}
+
+git_tree *GitBackend::getHeadTree(Handle *handle)
+{
+	git_commit *head = getHead(handle);
+	if(head && !handle->headTree && git_commit_tree(&handle->headTree, head)) {
+		handle->headTree = NULL;
+	}
+	return handle->headTree;
+}
+
+void GitBackend::clearHead(Handle *handle)
+{
+	git_tree_free(handle->headTree);
+	git_commit_free(handle->head);
+	handle->headTree = NULL;
+	handle->head = NULL;
+	handle->headValid = false;
+}
+
+static void appendFileStamp(std::string &stamp, const std::string &path)
+{
+	struct stat st;
+	if(stat(path.c_str(), &st)) {
+		stamp += "-;";
+		return;
+	}
+	stamp += std::to_string(st.st_ino) + ":" + std::to_string(st.st_size) + ":"
+		+ std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec) + ";";
+}
+
+// Describes the state of the files HEAD is resolved from. Git replaces
+// the ref files by renaming so any update changes the stamp.
+std::string GitBackend::getRefStamp() const
+{
+	if(mPath.empty()) {
+		return "";
+	}
+	const std::string &gitDir = mPath;
+
+	std::ifstream headFile(gitDir + "HEAD");
+	std::string head;
+	std::getline(headFile, head);
+	std::string stamp = head + ";";
+
+	const std::string symbolic = "ref: ";
+	if(head.compare(0, symbolic.size(), symbolic) == 0) {
+		appendFileStamp(stamp, gitDir + head.substr(symbolic.size()));
+		appendFileStamp(stamp, gitDir + "packed-refs");
+	}
+	return stamp;
+}
+
+std::shared_ptr<const std::string> GitBackend::getBlob(Handle *handle, const git_oid *oid)
+{
+	{
+		std::lock_guard<std::mutex> lock(mBlobMutex);
+		auto iter = mBlobs.find(oidKey(oid));
+		if(iter != mBlobs.end()) {
+			return iter->second;
+		}
+	}
+
+	git_blob *blob;
+	if(git_blob_lookup(&blob, handle->repo, oid)) {
+		throw GitException("Failed to find blob");
+	}
+	auto content = std::make_shared<const std::string>((const char*)git_blob_rawcontent(blob), git_blob_rawsize(blob));
+	git_blob_free(blob);
+
+	cacheBlob(oid, content);
+	return content;
+}
+
+void GitBackend::cacheBlob(const git_oid *oid, std::shared_ptr<const std::string> content)
+{
+	if(content->size() > MAX_BLOB_CACHE_SIZE) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mBlobMutex);
+	if(mBlobCacheSize + content->size() > MAX_BLOB_CACHE_SIZE) {
+		mBlobs.clear();
+		mBlobCacheSize = 0;
+	}
+	auto &cached = mBlobs[oidKey(oid)];
+	if(!cached) {
+		mBlobCacheSize += content->size();
+	}
+	cached = content;
 }
 
 std::string GitBackend::getNextCommitMessage(struct git_commit *head)
@@ -166,30 +821,532 @@ std::string GitBackend::getNextCommitMessage(struct git_commit *head)
 	return std::to_string(index);
 }
 
+// Packs the loose objects and removes them. The report tells how many
+// loose objects there were and how long opening the repository took
+// before and after.
+MaintenanceReport GitBackend::maintain()
+{
+	std::lock_guard<std::mutex> lock(mWriteMutex);
+	return repack();
+}
+
+MaintenanceReport GitBackend::repack()
+{
+	MaintenanceReport report = MaintenanceReport();
+	std::string objectDir = getObjectDir();
+	std::vector<std::string> loose = findLooseObjects();
+	report.looseBefore = loose.size();
+	report.openMsBefore = measureOpen();
+
+	if(!loose.empty()) {
+		git_packbuilder *packer;
+		if(git_packbuilder_new(&packer, mMain.repo)) {
+			throw GitException("Failed to create pack builder");
+		}
+		for(const auto &name : loose) {
+			git_oid oid;
+			git_oid_fromstr(&oid, name.c_str());
+			if(git_packbuilder_insert(packer, &oid, NULL)) {
+				git_packbuilder_free(packer);
+				throw GitException("Failed to add object to pack");
+			}
+		}
+		if(git_packbuilder_write(packer, NULL, 0, NULL, NULL)) {
+			git_packbuilder_free(packer);
+			throw GitException("Failed to write pack");
+		}
+		report.packed = git_packbuilder_object_count(packer);
+		git_packbuilder_free(packer);
+
+		// the objects are in the pack now so the loose copies can go
+		for(const auto &name : loose) {
+			std::string dir = objectDir + name.substr(0, 2);
+			unlink((dir + "/" + name.substr(2)).c_str());
+			rmdir(dir.c_str());
+		}
+
+		git_odb *odb;
+		if(git_repository_odb(&odb, mMain.repo)) {
+			throw GitException("Failed to get object database");
+		}
+		git_odb_refresh(odb);
+#if LIBGIT2_VER_MAJOR > 1 || (LIBGIT2_VER_MAJOR == 1 && LIBGIT2_VER_MINOR >= 1)
+		// makes lookups fast when there are multiple packs, it is only an
+		// index so failing to write it is not an error
+		git_odb_write_multi_pack_index(odb);
+#endif
+		git_odb_free(odb);
+	}
+
+	report.looseAfter = findLooseObjects().size();
+	report.openMsAfter = measureOpen();
+	return report;
+}
+
+// The maintenance is run after commit when there are more loose objects
+// than the threshold, zero disables it.
+void GitBackend::setAutoMaintenance(unsigned int threshold)
+{
+	mAutoMaintenance = threshold;
+}
+
+std::string GitBackend::getObjectDir() const
+{
+	if(mPath.empty()) {
+		return "";
+	}
+	return mPath + "objects/";
+}
+
+static bool isHex(const char *str, size_t length)
+{
+	if(strlen(str) != length) {
+		return false;
+	}
+	return strspn(str, "0123456789abcdef") == length;
+}
+
+std::vector<std::string> GitBackend::findLooseObjects() const
+{
+	std::vector<std::string> objects;
+	std::string objectDir = getObjectDir();
+	if(objectDir.empty()) {
+		return objects;
+	}
+
+	DIR *root = opendir(objectDir.c_str());
+	if(!root) {
+		return objects;
+	}
+	while(struct dirent *dirEntry = readdir(root)) {
+		if(!isHex(dirEntry->d_name, 2)) continue;
+
+		std::string prefix = dirEntry->d_name;
+		DIR *dir = opendir((objectDir + prefix).c_str());
+		if(!dir) continue;
+		while(struct dirent *entry = readdir(dir)) {
+			if(isHex(entry->d_name, GIT_OID_HEXSZ - 2)) {
+				objects.push_back(prefix + entry->d_name);
+			}
+		}
+		closedir(dir);
+	}
+	closedir(root);
+	return objects;
+}
+
+// Counts the objects of a single fan-out directory like git gc --auto
+// does, the objects are evenly distributed by their hash.
+unsigned int GitBackend::estimateLooseObjects() const
+{
+	std::string objectDir = getObjectDir();
+	if(objectDir.empty()) {
+		return 0;
+	}
+	DIR *dir = opendir((objectDir + "17").c_str());
+	if(!dir) {
+		return 0;
+	}
+	unsigned int count = 0;
+	while(struct dirent *entry = readdir(dir)) {
+		if(isHex(entry->d_name, GIT_OID_HEXSZ - 2)) {
+			count++;
+		}
+	}
+	closedir(dir);
+	return count * 256;
+}
+
+// Measures how long opening the repository and reading HEAD takes
+double GitBackend::measureOpen() const
+{
+	if(mPath.empty()) {
+		return 0.0;
+	}
+	auto start = std::chrono::steady_clock::now();
+	git_repository *repo;
+	if(git_repository_open(&repo, mPath.c_str())) {
+		return 0.0;
+	}
+	git_reference *ref;
+	if(!git_repository_head(&ref, repo)) {
+		git_commit *commit;
+		if(!git_commit_lookup(&commit, repo, git_reference_target(ref))) {
+			git_tree *tree;
+			if(!git_commit_tree(&tree, commit)) {
+				git_tree_free(tree);
+			}
+			git_commit_free(commit);
+		}
+		git_reference_free(ref);
+	}
+	git_repository_free(repo);
+	std::chrono::duration<double, std::milli> time = std::chrono::steady_clock::now() - start;
+	return time.count();
+}
+
+// Can be called from many threads at once, each call uses its own
+// repository handle.
 std::streambuf *GitBackend::getFile(std::string path)
 {
-	git_tree *root;
-	git_commit *head = getHead();
-	git_commit_tree(&root, head);
-	git_commit_free(head);
+	Handle *handle = leaseHandle();
+	try {
+		std::streambuf *buf = readFile(handle, path);
+		releaseHandle(handle);
+		return buf;
+	} catch(...) {
+		releaseHandle(handle);
+		throw;
+	}
+}
+
+std::streambuf *GitBackend::readFile(Handle *handle, std::string path)
+{
+	git_tree *root = getHeadTree(handle);
+	if(!root) {
+		return NULL;
+	}
 
 	git_tree_entry *entry;
 	if(git_tree_entry_bypath(&entry, root, path.c_str())) {
-		git_tree_free(root);
 		return NULL;
 	}
-	git_tree_free(root);
 	if(git_tree_entry_type(entry) != GIT_OBJ_BLOB) {
+		git_tree_entry_free(entry);
 		throw GitException("entry is not a file");
 	}
-	git_blob *blob;
-	git_tree_entry_to_object((git_object**)&blob, mRepo, entry);
+	auto content = getBlob(handle, git_tree_entry_id(entry));
+	git_tree_entry_free(entry);
 	//TODO we should create InputStream so we would not need duplicate the content
-	std::string buf((const char*)git_blob_rawcontent(blob), 0, git_blob_rawsize(blob));
-	git_blob_free(blob);
+	return new std::basic_stringbuf<char>(*content);
+}
 
-	git_tree_entry_free(entry);
-	return new std::basic_stringbuf<char>(buf);
+static std::string toHex(const git_oid *oid)
+{
+	char hex[GIT_OID_HEXSZ + 1];
+	git_oid_tostr(hex, sizeof(hex), oid);
+	return hex;
+}
+
+// Returns the commit id the revision points to, or an empty string if
+// there is no such revision.
+std::string GitBackend::getCommit(std::string revision)
+{
+	Handle *handle = leaseHandle();
+	std::string id;
+	git_object *object;
+	if(!git_revparse_single(&object, handle->repo, revision.c_str())) {
+		git_object *commit;
+		if(!git_object_peel(&commit, object, GIT_OBJ_COMMIT)) {
+			id = toHex(git_object_id(commit));
+			git_object_free(commit);
+		}
+		git_object_free(object);
+	}
+	releaseHandle(handle);
+	return id;
+}
+
+// Returns the newest commit made at or before the time
+std::string GitBackend::findCommit(time_t time)
+{
+	Handle *handle = leaseHandle();
+	std::string id;
+	git_revwalk *walk;
+	if(!git_revwalk_new(&walk, handle->repo)) {
+		git_revwalk_sorting(walk, GIT_SORT_TIME);
+		git_oid oid;
+		if(!git_revwalk_push_head(walk)) {
+			while(!git_revwalk_next(&oid, walk)) {
+				git_commit *commit;
+				if(git_commit_lookup(&commit, handle->repo, &oid)) continue;
+				bool found = git_commit_time(commit) <= time;
+				git_commit_free(commit);
+				if(found) {
+					id = toHex(&oid);
+					break;
+				}
+			}
+		}
+		git_revwalk_free(walk);
+	}
+	releaseHandle(handle);
+	return id;
+}
+
+// Reads the file as it was in the revision
+std::streambuf *GitBackend::getFile(std::string path, std::string revision)
+{
+	Handle *handle = leaseHandle();
+	std::shared_ptr<const std::string> content;
+	git_object *object;
+	if(!git_revparse_single(&object, handle->repo, revision.c_str())) {
+		git_object *tree;
+		if(!git_object_peel(&tree, object, GIT_OBJ_TREE)) {
+			git_tree_entry *entry;
+			if(!git_tree_entry_bypath(&entry, (git_tree*)tree, path.c_str())) {
+				if(git_tree_entry_type(entry) == GIT_OBJ_BLOB) {
+					try {
+						content = getBlob(handle, git_tree_entry_id(entry));
+					} catch(GitException &e) {
+					}
+				}
+				git_tree_entry_free(entry);
+			}
+			git_object_free(tree);
+		}
+		git_object_free(object);
+	}
+	releaseHandle(handle);
+	if(!content) {
+		return NULL;
+	}
+	return new std::basic_stringbuf<char>(*content);
+}
+
+// Returns the blob id of the file in the commit, an empty string if the
+// file isn't in the commit
+static std::string getFileBlob(git_commit *commit, const std::string &path)
+{
+	std::string blob;
+	git_tree *tree;
+	if(!git_commit_tree(&tree, commit)) {
+		git_tree_entry *entry;
+		if(!git_tree_entry_bypath(&entry, tree, path.c_str())) {
+			blob = toHex(git_tree_entry_id(entry));
+			git_tree_entry_free(entry);
+		}
+		git_tree_free(tree);
+	}
+	return blob;
+}
+
+// Lists the commits reachable from until, or from HEAD, that changed the
+// file, oldest first. If since is given only the commits after it are
+// walked and the first one is compared to the file in since. Only the
+// trees are read so the walk stays cheap on long histories.
+std::vector<GitBackend::FileRevision> GitBackend::getFileHistory(std::string path, std::string since,
+	std::string until)
+{
+	std::vector<FileRevision> revisions;
+	Handle *handle = leaseHandle();
+	git_revwalk *walk;
+	if(git_revwalk_new(&walk, handle->repo)) {
+		releaseHandle(handle);
+		throw GitException("Failed to walk history");
+	}
+	git_revwalk_sorting(walk, GIT_SORT_TOPOLOGICAL | GIT_SORT_TIME | GIT_SORT_REVERSE);
+	git_oid oid;
+	if(until.empty() ? git_revwalk_push_head(walk)
+		: git_oid_fromstrn(&oid, until.c_str(), until.size()) || git_revwalk_push(walk, &oid)) {
+		git_revwalk_free(walk);
+		releaseHandle(handle);
+		return revisions;
+	}
+
+	std::string previous;
+	git_commit *commit;
+	if(!since.empty() && !git_oid_fromstrn(&oid, since.c_str(), since.size())
+		&& !git_commit_lookup(&commit, handle->repo, &oid)) {
+		git_revwalk_hide(walk, &oid);
+		previous = getFileBlob(commit, path);
+		git_commit_free(commit);
+	}
+
+	while(!git_revwalk_next(&oid, walk)) {
+		if(git_commit_lookup(&commit, handle->repo, &oid)) continue;
+		FileRevision revision;
+		revision.time = git_commit_time(commit);
+		revision.blob = getFileBlob(commit, path);
+		git_commit_free(commit);
+
+		if(revision.blob != previous) {
+			revision.commit = toHex(&oid);
+			previous = revision.blob;
+			revisions.push_back(revision);
+		}
+	}
+	git_revwalk_free(walk);
+	releaseHandle(handle);
+	return revisions;
+}
+
+std::shared_ptr<const std::string> GitBackend::readBlob(std::string id)
+{
+	git_oid oid;
+	if(git_oid_fromstrn(&oid, id.c_str(), id.size())) {
+		return NULL;
+	}
+	Handle *handle = leaseHandle();
+	std::shared_ptr<const std::string> content;
+	try {
+		content = getBlob(handle, &oid);
+	} catch(GitException &e) {
+	}
+	releaseHandle(handle);
+	return content;
+}
+
+// Lists the commits reachable from HEAD that are not reachable from the
+// since commit, oldest first. The walk stops at the since commit so only
+// the new commits are read. The current HEAD is stored to head.
+std::vector<GitBackend::CommitInfo> GitBackend::getNewCommits(std::string since, std::string *head)
+{
+	std::vector<CommitInfo> commits;
+	Handle *handle = leaseHandle();
+	git_revwalk *walk;
+	if(git_revwalk_new(&walk, handle->repo)) {
+		releaseHandle(handle);
+		throw GitException("Failed to walk history");
+	}
+	git_revwalk_sorting(walk, GIT_SORT_TOPOLOGICAL | GIT_SORT_REVERSE);
+	git_oid oid;
+	if(git_reference_name_to_id(&oid, handle->repo, "HEAD") || git_revwalk_push(walk, &oid)) {
+		git_revwalk_free(walk);
+		releaseHandle(handle);
+		return commits;
+	}
+	if(head) {
+		*head = toHex(&oid);
+	}
+	// if the commit is gone the history was rewritten, then everything
+	// is walked again
+	if(!since.empty() && !git_oid_fromstrn(&oid, since.c_str(), since.size())) {
+		git_revwalk_hide(walk, &oid);
+	}
+
+	while(!git_revwalk_next(&oid, walk)) {
+		git_commit *commit;
+		if(git_commit_lookup(&commit, handle->repo, &oid)) continue;
+		CommitInfo info;
+		info.id = toHex(&oid);
+		info.message = git_commit_message(commit);
+		info.author = git_commit_author(commit)->name;
+		info.time = git_commit_time(commit);
+		commits.push_back(info);
+		git_commit_free(commit);
+	}
+	git_revwalk_free(walk);
+	releaseHandle(handle);
+	return commits;
+}
+
+// Returns the blob id of the file in the revision, the id of the root
+// tree if the path is empty
+std::string GitBackend::getFileId(std::string path, std::string revision)
+{
+	Handle *handle = leaseHandle();
+	std::string id;
+	git_object *object;
+	if(!git_revparse_single(&object, handle->repo, revision.c_str())) {
+		git_object *tree;
+		if(!git_object_peel(&tree, object, GIT_OBJ_TREE)) {
+			git_tree_entry *entry;
+			if(path.empty()) {
+				id = toHex(git_object_id(tree));
+			} else if(!git_tree_entry_bypath(&entry, (git_tree*)tree, path.c_str())) {
+				id = toHex(git_tree_entry_id(entry));
+				git_tree_entry_free(entry);
+			}
+			git_object_free(tree);
+		}
+		git_object_free(object);
+	}
+	releaseHandle(handle);
+	return id;
+}
+
+// The branch HEAD points to
+std::string GitBackend::getBranch(git_repository *repo)
+{
+	std::string branch = "refs/heads/master";
+	git_reference *head;
+	if(!git_reference_lookup(&head, repo, "HEAD")) {
+		if(git_reference_type(head) == GIT_REFERENCE_SYMBOLIC) {
+			branch = git_reference_symbolic_target(head);
+		}
+		git_reference_free(head);
+	}
+	return branch;
+}
+
+static const char *FETCHED_REF = "refs/tasker/fetched";
+
+// Fetches the branch of the other repository, returns the fetched commit
+// or an empty string if the other repository has no such branch.
+std::string GitBackend::fetch(std::string url)
+{
+	std::lock_guard<std::mutex> lock(mWriteMutex);
+	std::string refspec = "+" + getBranch(mMain.repo) + ":" + FETCHED_REF;
+	char *refspecs[] = {(char*)refspec.c_str()};
+	git_strarray specs = {refspecs, 1};
+
+	git_reference_remove(mMain.repo, FETCHED_REF);
+	git_remote *remote;
+	if(git_remote_create_anonymous(&remote, mMain.repo, url.c_str())) {
+		throw GitException("Invalid remote");
+	}
+	int ret = git_remote_fetch(remote, &specs, NULL, NULL);
+	git_remote_free(remote);
+	if(ret) {
+		throw GitException("Fetch failed");
+	}
+
+	git_oid oid;
+	if(git_reference_name_to_id(&oid, mMain.repo, FETCHED_REF)) {
+		return "";
+	}
+	return toHex(&oid);
+}
+
+// Pushes the branch to the other repository, it fails if the branch of
+// the other repository has commits that are not merged.
+void GitBackend::push(std::string url)
+{
+	std::lock_guard<std::mutex> lock(mWriteMutex);
+	std::string branch = getBranch(mMain.repo);
+	std::string refspec = branch + ":" + branch;
+	char *refspecs[] = {(char*)refspec.c_str()};
+	git_strarray specs = {refspecs, 1};
+
+	git_remote *remote;
+	if(git_remote_create_anonymous(&remote, mMain.repo, url.c_str())) {
+		throw GitException("Invalid remote");
+	}
+	int ret = git_remote_push(remote, &specs, NULL);
+	git_remote_free(remote);
+	if(ret) {
+		throw GitException("Push failed");
+	}
+}
+
+std::string GitBackend::getMergeBase(std::string one, std::string two)
+{
+	git_oid first, second, base;
+	if(git_oid_fromstrn(&first, one.c_str(), one.size())
+		|| git_oid_fromstrn(&second, two.c_str(), two.size())) {
+		return "";
+	}
+	Handle *handle = leaseHandle();
+	int ret = git_merge_base(&base, handle->repo, &first, &second);
+	releaseHandle(handle);
+	return ret ? "" : toHex(&base);
+}
+
+// Moves the current branch to the commit
+void GitBackend::setHead(std::string commit)
+{
+	git_oid oid;
+	if(git_oid_fromstrn(&oid, commit.c_str(), commit.size())) {
+		throw GitException("Invalid commit");
+	}
+	std::lock_guard<std::mutex> lock(mWriteMutex);
+	git_reference *ref;
+	if(git_reference_create(&ref, mMain.repo, getBranch(mMain.repo).c_str(), &oid, 1, "fast-forward")) {
+		throw GitException("Failed to move HEAD");
+	}
+	git_reference_free(ref);
+	clearHead(&mMain);
 }
 
 GitFileBuffer::GitFileBuffer(GitBackend *backend, std::string file)
@@ -203,11 +1360,12 @@ GitFileBuffer::~GitFileBuffer()
 	git_oid oid;
 	git_blob *blob;
 
-	if(git_blob_create_frombuffer(&oid, mBackend->mRepo, mBuf.c_str(), mBuf.size())) {
+	std::lock_guard<std::mutex> lock(mBackend->mWriteMutex);
+	if(git_blob_create_frombuffer(&oid, mBackend->mMain.repo, mBuf.c_str(), mBuf.size())) {
 		throw GitException("Failed to create file from string");
 	}
 
-	if(git_blob_lookup(&blob, mBackend->mRepo, &oid)) {
+	if(git_blob_lookup(&blob, mBackend->mMain.repo, &oid)) {
 		throw GitException("Failed to find new blob");
 	}
 
@@ -215,6 +1373,7 @@ GitFileBuffer::~GitFileBuffer()
 		throw GitException("Can't insert blob to tree");
 	}
 	git_blob_free(blob);
+	mBackend->cacheBlob(&oid, std::make_shared<const std::string>(std::move(mBuf)));
 }
 
 int GitFileBuffer::overflow(int c)
@@ -224,5 +1383,11 @@ int GitFileBuffer::overflow(int c)
 	return 1;
 }
 
+std::streamsize GitFileBuffer::xsputn(const char* s, std::streamsize n)
+{
+	mBuf.append(s, n);
+	return n;
+}
+
 };
 };
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <ctime>
 #include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <streambuf>
 
@@ -9,6 +13,14 @@ namespace Backend {
 
 class GitBackend;
 
+struct MaintenanceReport {
+	unsigned int looseBefore;
+	unsigned int looseAfter;
+	unsigned int packed;
+	double openMsBefore;
+	double openMsAfter;
+};
+
 class GitException : public std::exception {
 public:
 	GitException(std::string &source);
@@ -29,7 +41,7 @@ public:
 
 	void close(struct git_oid *oid);
 
-	//streamsize xsputn(const char* s, streamsize n) override;
+	std::streamsize xsputn(const char* s, std::streamsize n) override;
 	int overflow(int c) override;
 private:
 	std::string mBuf;
@@ -39,21 +51,95 @@ private:
 
 class GitBackend {
 public:
+	// A version of a file, the blob is empty if the file did not exist
+	struct FileRevision {
+		std::string commit;
+		std::string blob;
+		time_t time;
+	};
+	struct CommitInfo {
+		std::string id;
+		std::string message;
+		std::string author;
+		time_t time;
+	};
+
 	GitBackend();
 	~GitBackend();
 	static GitBackend *open(std::string path);
 	static GitBackend *create(std::string path);
+	static GitBackend *createRemote(std::string path);
+	static GitBackend *clone(std::string url, std::string path);
+	static GitBackend *createInMemory();
+	std::string getPath() const;
 
 	GitFileBuffer *addFile(std::string file);
 	std::streambuf *getFile(std::string path);
-	void commit();
+	void commit(std::string message = "", std::string mergeParent = "");
+
+	std::string getCommit(std::string revision);
+	std::string findCommit(time_t time);
+	std::streambuf *getFile(std::string path, std::string revision);
+	std::vector<FileRevision> getFileHistory(std::string path, std::string since = "",
+		std::string until = "");
+	std::shared_ptr<const std::string> readBlob(std::string id);
+	std::vector<CommitInfo> getNewCommits(std::string since, std::string *head);
+	std::string getFileId(std::string path, std::string revision);
+
+	std::string fetch(std::string url);
+	void push(std::string url);
+	std::string getMergeBase(std::string one, std::string two);
+	void setHead(std::string commit);
+
+	MaintenanceReport maintain();
+	void setAutoMaintenance(unsigned int threshold);
 private:
-	struct git_commit *getHead();
+	// A repository handle with its own view of HEAD. A libgit2 repository
+	// must not be used by many threads at once so every reader leases one.
+	struct Handle {
+		Handle() :repo(NULL), head(NULL), headTree(NULL), headValid(false) {}
+		struct git_repository *repo;
+		struct git_commit *head;
+		struct git_tree *headTree;
+		bool headValid;
+		std::string refStamp;
+	};
+
+	Handle *leaseHandle();
+	void releaseHandle(Handle *handle);
+	std::streambuf *readFile(Handle *handle, std::string path);
+	struct git_commit *getHead(Handle *handle);
+	struct git_tree *getHeadTree(Handle *handle);
+	void startTree();
+	static void clearHead(Handle *handle);
+	static std::string getBranch(struct git_repository *repo);
+	std::string getRefStamp() const;
+	MaintenanceReport repack();
+	std::shared_ptr<const std::string> getBlob(Handle *handle, const struct git_oid *oid);
+	void cacheBlob(const struct git_oid *oid, std::shared_ptr<const std::string> content);
 	std::string getNextCommitMessage(struct git_commit *head);
+	std::string getObjectDir() const;
+	std::vector<std::string> findLooseObjects() const;
+	unsigned int estimateLooseObjects() const;
+	double measureOpen() const;
 
-	struct git_repository *mRepo;
+	// the handle for writing, mWriteMutex must be held while using it
+	Handle mMain;
 	struct git_treebuilder *mTreeBuilder;
+	unsigned int mAutoMaintenance;
+	std::string mPath;
+	std::mutex mWriteMutex;
+
+	std::vector<Handle*> mHandles;
+	std::vector<Handle*> mFreeHandles;
+	std::mutex mHandleMutex;
+
+	std::map<std::string, std::shared_ptr<const std::string> > mBlobs;
+	size_t mBlobCacheSize;
+	std::mutex mBlobMutex;
+
 	static int refs_to_lib;
+	static std::mutex lib_mutex;
 
 	friend GitFileBuffer::~GitFileBuffer();
 };
@@ -0,0 +1,672 @@
+/* Task history over the task repository
+ *
+ * Copyright (C) 2017 Aleksi Salmela
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+
+#include <sstream>
+#include <set>
+
+#include "history.h"
+#include "git.h"
+
+namespace Tasker {
+namespace Backend {
+
+/// TaskIndex
+
+static uint64_t hashRange(const char *data, size_t length)
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	for(size_t i = 0; i < length; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static size_t skipSpace(const std::string &json, size_t pos)
+{
+	while(pos < json.size() && isspace((unsigned char)json[pos])) {
+		pos++;
+	}
+	return pos;
+}
+
+// Returns the position after the JSON value that starts at pos
+static size_t skipValue(const std::string &json, size_t pos)
+{
+	int depth = 0;
+	bool inString = false;
+	for(; pos < json.size(); pos++) {
+		char c = json[pos];
+		if(inString) {
+			if(c == '\\') {
+				pos++;
+			} else if(c == '"') {
+				inString = false;
+				if(depth == 0) return pos + 1;
+			}
+			continue;
+		}
+		switch(c) {
+		case '"':
+			inString = true;
+			break;
+		case '{':
+		case '[':
+			depth++;
+			break;
+		case '}':
+		case ']':
+			if(depth == 0) return pos;
+			depth--;
+			if(depth == 0) return pos + 1;
+			break;
+		case ',':
+		case ' ':
+		case '\t':
+		case '\n':
+		case '\r':
+			if(depth == 0) return pos;
+			break;
+		}
+	}
+	return pos;
+}
+
+// Calls func(key, valueBegin, valueEnd) for the members of the object
+// that starts at pos until it returns false.
+template<typename Func>
+static void forEachField(const std::string &json, size_t pos, Func func)
+{
+	pos = skipSpace(json, pos);
+	if(pos >= json.size() || json[pos] != '{') return;
+	pos++;
+	while(true) {
+		pos = skipSpace(json, pos);
+		if(pos >= json.size() || json[pos] != '"') return;
+		size_t keyEnd = skipValue(json, pos);
+		if(keyEnd < pos + 2) return;
+		std::string key = json.substr(pos + 1, keyEnd - pos - 2);
+
+		pos = skipSpace(json, keyEnd);
+		if(pos >= json.size() || json[pos] != ':') return;
+		pos = skipSpace(json, pos + 1);
+		size_t valueEnd = skipValue(json, pos);
+		if(!func(key, pos, valueEnd)) return;
+
+		pos = skipSpace(json, valueEnd);
+		if(pos >= json.size() || json[pos] != ',') return;
+		pos++;
+	}
+}
+
+std::shared_ptr<const TaskIndex> TaskIndex::scan(std::shared_ptr<const std::string> content)
+{
+	auto index = std::make_shared<TaskIndex>();
+	index->mContent = content;
+	const std::string &json = *content;
+
+	size_t pos = skipSpace(json, 0);
+	if(pos >= json.size() || json[pos] != '[') return index;
+	pos++;
+	while(true) {
+		pos = skipSpace(json, pos);
+		if(pos >= json.size() || json[pos] == ']') break;
+		size_t end = skipValue(json, pos);
+		if(end == pos) break;
+
+		Entry entry = {pos, end - pos, hashRange(json.data() + pos, end - pos)};
+		forEachField(json, pos, [&](const std::string &key, size_t begin, size_t valueEnd) {
+			if(key != "id") return true;
+			index->mTasks[strtoul(json.c_str() + begin, NULL, 10)] = entry;
+			return false;
+		});
+
+		pos = skipSpace(json, end);
+		if(pos < json.size() && json[pos] == ',') pos++;
+	}
+	return index;
+}
+
+const TaskIndex::Entry *TaskIndex::find(unsigned int id) const
+{
+	auto iter = mTasks.find(id);
+	return (iter != mTasks.end()) ? &iter->second : NULL;
+}
+
+const std::map<unsigned int, TaskIndex::Entry> &TaskIndex::getTasks() const
+{
+	return mTasks;
+}
+
+std::string TaskIndex::getTask(const Entry &entry) const
+{
+	return mContent->substr(entry.offset, entry.length);
+}
+
+// Returns the members of the JSON object as unparsed values in the order
+// they are in the object
+TaskIndex::FieldList TaskIndex::scanFieldList(const std::string &json)
+{
+	FieldList fields;
+	forEachField(json, 0, [&](const std::string &key, size_t begin, size_t end) {
+		fields.push_back(std::make_pair(key, json.substr(begin, end - begin)));
+		return true;
+	});
+	return fields;
+}
+
+std::map<std::string, std::string> TaskIndex::scanFields(const std::string &json)
+{
+	auto fields = scanFieldList(json);
+	return std::map<std::string, std::string>(fields.begin(), fields.end());
+}
+
+// Returns the task at the offset as an object that has only the fields
+// read by Task::readFields(METADATA). The date of the last event is read
+// without parsing the other events.
+std::string TaskIndex::scanMetadata(const std::string &json, size_t offset, std::string *lastDate,
+	bool *hasSubTasks)
+{
+	if(hasSubTasks) {
+		*hasSubTasks = false;
+	}
+	static const std::set<std::string> keys = {
+		"id", "name", "type", "state", "assigned", "creation-time"
+	};
+	std::string metadata = "{";
+	forEachField(json, offset, [&](const std::string &key, size_t begin, size_t end) {
+		if(keys.count(key)) {
+			if(metadata.size() > 1) metadata += ",";
+			metadata += "\"" + key + "\":";
+			metadata.append(json, begin, end - begin);
+		} else if(key == "sub-tasks" && hasSubTasks) {
+			size_t pos = skipSpace(json, begin + 1);
+			*hasSubTasks = pos < end && json[pos] != ']';
+		} else if(key == "events" && lastDate) {
+			size_t last = std::string::npos;
+			size_t pos = skipSpace(json, begin + 1);
+			while(pos < end && json[pos] == '{') {
+				last = pos;
+				pos = skipSpace(json, skipValue(json, pos));
+				if(pos < end && json[pos] == ',') pos = skipSpace(json, pos + 1);
+			}
+			lastDate->clear();
+			if(last != std::string::npos) {
+				forEachField(json, last, [&](const std::string &eventKey, size_t dateBegin, size_t dateEnd) {
+					if(eventKey != "date" || dateEnd - dateBegin < 2) return true;
+					*lastDate = json.substr(dateBegin + 1, dateEnd - dateBegin - 2);
+					return false;
+				});
+			}
+		}
+		return true;
+	});
+	return metadata + "}";
+}
+
+// Writes the fields back to a task object like Task::serialize does
+std::string TaskIndex::writeFields(const FieldList &fields)
+{
+	std::ostringstream stream;
+	FJson::Writer out(stream, true, 1);
+	out.startObject();
+	for(const auto &field : fields) {
+		out.writeObjectKey(field.first);
+		out.writeRaw(field.second);
+	}
+	out.endObject();
+	return stream.str();
+}
+
+/// TaskMerge
+
+// Merges the task arrays. The tasks added on both sides get the same ids
+// so the tasks added by them are moved after our tasks. The new ids start
+// from the next id so that the ids removed on either side aren't reused,
+// the next id is updated to the first unused id.
+std::string TaskMerge::merge(const TaskIndex &base, const TaskIndex &ours,
+	const TaskIndex &theirs, unsigned int &nextId, Project::MergeStats &stats)
+{
+	std::set<unsigned int> ids;
+	for(const auto &task : base.getTasks()) ids.insert(task.first);
+	for(const auto &task : ours.getTasks()) ids.insert(task.first);
+	for(const auto &task : theirs.getTasks()) ids.insert(task.first);
+
+	std::map<unsigned int, std::string> tasks;
+	std::vector<std::string> renumbered;
+	for(unsigned int id : ids) {
+		const TaskIndex::Entry *b = base.find(id);
+		const TaskIndex::Entry *o = ours.find(id);
+		const TaskIndex::Entry *t = theirs.find(id);
+		if(!b) {
+			if(o) {
+				tasks[id] = ours.getTask(*o);
+			}
+			if(t && !o) {
+				tasks[id] = theirs.getTask(*t);
+			} else if(t && o->hash != t->hash) {
+				renumbered.push_back(theirs.getTask(*t));
+			}
+		} else if(!o || !t) {
+			// a removed task is kept if the other side changed it
+			if(o && o->hash != b->hash) {
+				tasks[id] = ours.getTask(*o);
+			} else if(t && t->hash != b->hash) {
+				tasks[id] = theirs.getTask(*t);
+			}
+		} else if(t->hash == b->hash || t->hash == o->hash) {
+			tasks[id] = ours.getTask(*o);
+		} else if(o->hash == b->hash) {
+			tasks[id] = theirs.getTask(*t);
+		} else {
+			tasks[id] = mergeFields(base.getTask(*b), ours.getTask(*o), theirs.getTask(*t), stats);
+			stats.tasksMerged++;
+		}
+	}
+
+	if(!tasks.empty()) {
+		nextId = std::max(nextId, tasks.rbegin()->first + 1);
+	}
+	for(const auto &task : renumbered) {
+		tasks[nextId] = setId(task, nextId);
+		nextId++;
+		stats.tasksRenumbered++;
+	}
+
+	std::ostringstream stream;
+	FJson::Writer out(stream, true);
+	out.startArray();
+	for(const auto &task : tasks) {
+		out.startNextElement();
+		out.writeRaw(task.second);
+	}
+	out.endArray();
+	return stream.str();
+}
+
+// Takes the changed fields from both sides. The events of both sides are
+// kept, for other fields changed on both sides our value wins.
+std::string TaskMerge::mergeFields(const std::string &base, const std::string &ours,
+	const std::string &theirs, Project::MergeStats &stats, bool isTask)
+{
+	auto baseFields = TaskIndex::scanFields(base);
+	auto ourFields = TaskIndex::scanFieldList(ours);
+	auto theirFields = TaskIndex::scanFieldList(theirs);
+	std::map<std::string, std::string> theirValues(theirFields.begin(), theirFields.end());
+
+	std::set<std::string> keys;
+	TaskIndex::FieldList keyOrder;
+	for(const auto &field : ourFields) {
+		if(keys.insert(field.first).second) keyOrder.push_back(field);
+	}
+	for(const auto &field : theirFields) {
+		if(keys.insert(field.first).second) keyOrder.push_back(std::make_pair(field.first, ""));
+	}
+
+	TaskIndex::FieldList merged;
+	for(const auto &field : keyOrder) {
+		const std::string &key = field.first;
+		const std::string &our = field.second;
+		const std::string &their = theirValues[key];
+		const std::string &original = baseFields[key];
+
+		std::string value;
+		if(our == their || their == original) {
+			value = our;
+		} else if(our == original) {
+			value = their;
+		} else if(key == "events" && isTask) {
+			value = mergeArrays(our, their);
+		} else {
+			value = our;
+			stats.conflicts++;
+		}
+		if(!value.empty()) {
+			merged.push_back(std::make_pair(key, value));
+		}
+	}
+	return TaskIndex::writeFields(merged);
+}
+
+// Merges the project configuration. The types are merged by their names
+// so that the types added by them are kept, the other fields are merged
+// like the fields of a task. The next task id is given by the caller.
+std::string TaskMerge::mergeConfig(const std::string &base, const std::string &ours,
+	const std::string &theirs, unsigned int nextId, Project::MergeStats &stats)
+{
+	auto baseFields = TaskIndex::scanFields(base);
+	auto ourFields = TaskIndex::scanFieldList(ours);
+	auto theirFields = TaskIndex::scanFieldList(theirs);
+	std::map<std::string, std::string> ourValues(ourFields.begin(), ourFields.end());
+	std::map<std::string, std::string> theirValues(theirFields.begin(), theirFields.end());
+
+	std::string types = mergeFields(baseFields["types"], ourValues["types"],
+		theirValues["types"], stats, false);
+	if(!ourValues.count("next-task-id")) {
+		ourFields.push_back(std::make_pair("next-task-id", ""));
+	}
+
+	// both sides get the merged values so that they don't conflict
+	for(auto *fields : {&ourFields, &theirFields}) {
+		for(auto &field : *fields) {
+			if(field.first == "types") {
+				field.second = types;
+			} else if(field.first == "next-task-id") {
+				field.second = std::to_string(nextId);
+			}
+		}
+	}
+	return mergeFields(base, TaskIndex::writeFields(ourFields),
+		TaskIndex::writeFields(theirFields), stats, false);
+}
+
+unsigned int TaskMerge::getNextId(const std::string &config)
+{
+	return strtoul(TaskIndex::scanFields(config)["next-task-id"].c_str(), NULL, 10);
+}
+
+// Returns the elements of the JSON array as unparsed values
+static std::vector<std::string> scanElements(const std::string &json)
+{
+	std::vector<std::string> values;
+	size_t pos = skipSpace(json, 0);
+	if(pos >= json.size() || json[pos] != '[') return values;
+	pos = skipSpace(json, pos + 1);
+	while(pos < json.size() && json[pos] != ']') {
+		size_t end = skipValue(json, pos);
+		if(end == pos) break;
+		values.push_back(json.substr(pos, end - pos));
+		pos = skipSpace(json, end);
+		if(pos < json.size() && json[pos] == ',') pos = skipSpace(json, pos + 1);
+	}
+	return values;
+}
+
+// Our elements followed by their elements that we don't have
+std::string TaskMerge::mergeArrays(const std::string &ours, const std::string &theirs)
+{
+	auto merged = scanElements(ours);
+	std::set<std::string> known(merged.begin(), merged.end());
+	for(const auto &element : scanElements(theirs)) {
+		if(!known.count(element)) {
+			merged.push_back(element);
+		}
+	}
+
+	std::ostringstream stream;
+	FJson::Writer out(stream, true, 2);
+	out.startArray();
+	for(const auto &element : merged) {
+		out.startNextElement();
+		out.writeRaw(element);
+	}
+	out.endArray();
+	return stream.str();
+}
+
+std::string TaskMerge::setId(const std::string &task, unsigned int id)
+{
+	auto fields = TaskIndex::scanFieldList(task);
+	for(auto &field : fields) {
+		if(field.first == "id") {
+			field.second = std::to_string(id);
+		}
+	}
+	return TaskIndex::writeFields(fields);
+}
+
+/// TaskHistory
+
+TaskHistory::TaskHistory(GitBackend *storage, std::string taskFile, size_t cacheSize)
+	:mStorage(storage), mTaskFile(taskFile), mCacheSize(cacheSize)
+{
+}
+
+// Lists the changes of the task from the oldest to the newest. Only the
+// revisions where the serialized task differs are compared field by
+// field.
+std::vector<TaskChange> TaskHistory::getChanges(unsigned int id)
+{
+	std::vector<TaskChange> changes;
+	std::map<std::string, std::string> previous;
+	uint64_t previousHash = 0;
+	bool exists = false;
+
+	for(const auto &revision : getRevisions()) {
+		auto index = getIndex(revision.blob);
+		const TaskIndex::Entry *entry = index ? index->find(id) : NULL;
+		if(!entry) {
+			if(exists) {
+				changes.push_back({revision.commit, Date(revision.time), "removed", "", ""});
+				previous.clear();
+				exists = false;
+			}
+			continue;
+		}
+		if(exists && entry->hash == previousHash) {
+			continue;
+		}
+
+		auto fields = TaskIndex::scanFields(index->getTask(*entry));
+		if(!exists) {
+			changes.push_back({revision.commit, Date(revision.time), "created", "", formatValue(fields["name"])});
+		} else {
+			std::set<std::string> keys;
+			for(const auto &field : previous) keys.insert(field.first);
+			for(const auto &field : fields) keys.insert(field.first);
+			for(const auto &key : keys) {
+				const std::string &before = previous[key];
+				const std::string &after = fields[key];
+				if(before != after) {
+					changes.push_back({revision.commit, Date(revision.time), key, formatValue(before), formatValue(after)});
+				}
+			}
+		}
+		previous = fields;
+		previousHash = entry->hash;
+		exists = true;
+	}
+	return changes;
+}
+
+// Lists the commits that changed the task file. When HEAD has moved
+// forward only the new commits are walked, a rewritten history is walked
+// again from the start.
+std::vector<GitBackend::FileRevision> TaskHistory::getRevisions()
+{
+	std::string head = mStorage->getCommit("HEAD");
+	std::lock_guard<std::mutex> lock(mMutex);
+	if(head != mHead) {
+		bool forward = !mHead.empty() && mStorage->getMergeBase(mHead, head) == mHead;
+		auto revisions = mStorage->getFileHistory(mTaskFile, forward ? mHead : "", head);
+		if(!forward) {
+			mRevisions.clear();
+		}
+		mRevisions.insert(mRevisions.end(), revisions.begin(), revisions.end());
+		mHead = head;
+	}
+	return mRevisions;
+}
+
+std::shared_ptr<const TaskIndex> TaskHistory::getIndex(const std::string &blob)
+{
+	if(blob.empty()) {
+		return NULL;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		auto iter = mCacheIndex.find(blob);
+		if(iter != mCacheIndex.end()) {
+			mCache.splice(mCache.begin(), mCache, iter->second);
+			return iter->second->second;
+		}
+	}
+
+	auto content = mStorage->readBlob(blob);
+	if(!content) {
+		return NULL;
+	}
+	auto index = TaskIndex::scan(content);
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	if(mCacheIndex.count(blob)) {
+		return index;
+	}
+	mCache.push_front(CacheEntry(blob, index));
+	mCacheIndex[blob] = mCache.begin();
+	if(mCache.size() > mCacheSize) {
+		mCacheIndex.erase(mCache.back().first);
+		mCache.pop_back();
+	}
+	return index;
+}
+
+// Lists the tasks that differ between the revisions. The whole
+// repository and the task file are compared by their ids and only the
+// tasks with different hashes are compared field by field.
+std::vector<TaskDiff> TaskHistory::diff(const std::string &from, const std::string &to)
+{
+	std::vector<TaskDiff> diffs;
+	if(mStorage->getFileId("", from) == mStorage->getFileId("", to)) {
+		return diffs;
+	}
+	std::string fromBlob = mStorage->getFileId(mTaskFile, from);
+	std::string toBlob = mStorage->getFileId(mTaskFile, to);
+	if(fromBlob == toBlob) {
+		return diffs;
+	}
+
+	auto empty = TaskIndex::scan(std::make_shared<const std::string>("[]"));
+	auto before = getIndex(fromBlob);
+	auto after = getIndex(toBlob);
+	if(!before) before = empty;
+	if(!after) after = empty;
+
+	auto iter = before->getTasks().begin(), end = before->getTasks().end();
+	for(const auto &task : after->getTasks()) {
+		for(; iter != end && iter->first < task.first; iter++) {
+			TaskDiff removed = compare(before->getTask(iter->second), "");
+			removed.kind = TaskDiff::REMOVED;
+			diffs.push_back(removed);
+		}
+		if(iter != end && iter->first == task.first) {
+			if(iter->second.hash != task.second.hash) {
+				diffs.push_back(compare(before->getTask(iter->second), after->getTask(task.second)));
+			}
+			iter++;
+		} else {
+			TaskDiff added = compare("", after->getTask(task.second));
+			added.kind = TaskDiff::ADDED;
+			diffs.push_back(added);
+		}
+	}
+	for(; iter != end; iter++) {
+		TaskDiff removed = compare(before->getTask(iter->second), "");
+		removed.kind = TaskDiff::REMOVED;
+		diffs.push_back(removed);
+	}
+	return diffs;
+}
+
+TaskDiff TaskHistory::compare(const std::string &before, const std::string &after)
+{
+	auto oldFields = TaskIndex::scanFields(before);
+	auto newFields = TaskIndex::scanFields(after);
+	auto &fields = after.empty() ? oldFields : newFields;
+
+	TaskDiff diff;
+	diff.kind = TaskDiff::MODIFIED;
+	diff.id = strtoul(fields["id"].c_str(), NULL, 10);
+	diff.name = formatValue(fields["name"]);
+	if(before.empty() || after.empty()) {
+		return diff;
+	}
+
+	std::set<std::string> keys;
+	for(const auto &field : oldFields) keys.insert(field.first);
+	for(const auto &field : newFields) keys.insert(field.first);
+	for(const auto &key : keys) {
+		const std::string &oldValue = oldFields[key];
+		const std::string &newValue = newFields[key];
+		if(oldValue == newValue) {
+			continue;
+		}
+		if(key != "events") {
+			diff.fields.push_back(key);
+			continue;
+		}
+		auto oldEvents = scanElements(oldValue);
+		std::set<std::string> known(oldEvents.begin(), oldEvents.end());
+		for(const auto &event : scanElements(newValue)) {
+			if(!known.count(event)) {
+				diff.events.push_back(formatValue(TaskIndex::scanFields(event)["type"]));
+			}
+		}
+		if(diff.events.empty()) {
+			diff.fields.push_back(key);
+		}
+	}
+	return diff;
+}
+
+// Makes a stored value readable. Strings are unquoted, text stored as an
+// array of lines is joined and other arrays are summarized.
+std::string TaskHistory::formatValue(const std::string &json)
+{
+	if(json.empty() || (json[0] != '"' && json[0] != '[')) {
+		return json;
+	}
+	try {
+		std::istringstream stream(json);
+		FJson::Reader in(stream);
+		std::string text;
+		if(json[0] == '"') {
+			in.read(text);
+		} else {
+			in.readLines(text);
+		}
+		return text;
+	} catch(...) {
+	}
+
+	// not text
+	unsigned int count = 0;
+	try {
+		std::istringstream stream(json);
+		FJson::Reader in(stream);
+		in.startArray();
+		while(in.hasNextElement()) {
+			in.skipValue();
+			count++;
+		}
+	} catch(...) {
+		return json;
+	}
+	return "[" + std::to_string(count) + " items]";
+}
+
+};
+};
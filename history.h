@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+#include "backend.h"
+#include "git.h"
+
+namespace Tasker {
+namespace Backend {
+
+// Positions of the tasks in a serialized task array. The array is only
+// scanned, the tasks are not parsed.
+class TaskIndex
+{
+public:
+	struct Entry {
+		size_t offset;
+		size_t length;
+		uint64_t hash;
+	};
+
+	typedef std::vector<std::pair<std::string, std::string> > FieldList;
+
+	static std::shared_ptr<const TaskIndex> scan(std::shared_ptr<const std::string> content);
+	const Entry *find(unsigned int id) const;
+	const std::map<unsigned int, Entry> &getTasks() const;
+	std::string getTask(const Entry &entry) const;
+
+	static FieldList scanFieldList(const std::string &json);
+	static std::map<std::string, std::string> scanFields(const std::string &json);
+	static std::string writeFields(const FieldList &fields);
+	static std::string scanMetadata(const std::string &json, size_t offset, std::string *lastDate,
+		bool *hasSubTasks = NULL);
+private:
+	std::shared_ptr<const std::string> mContent;
+	std::map<unsigned int, Entry> mTasks;
+};
+
+// Three way merge of task arrays. The tasks are compared by their hashes
+// and only the tasks changed on both sides are merged field by field.
+class TaskMerge
+{
+public:
+	static std::string merge(const TaskIndex &base, const TaskIndex &ours,
+		const TaskIndex &theirs, unsigned int &nextId, Project::MergeStats &stats);
+	static std::string mergeConfig(const std::string &base, const std::string &ours,
+		const std::string &theirs, unsigned int nextId, Project::MergeStats &stats);
+	static unsigned int getNextId(const std::string &config);
+private:
+	static std::string mergeFields(const std::string &base, const std::string &ours,
+		const std::string &theirs, Project::MergeStats &stats, bool isTask = true);
+	static std::string mergeArrays(const std::string &ours, const std::string &theirs);
+	static std::string setId(const std::string &task, unsigned int id);
+};
+
+// Field level history of the tasks, the scanned task files are kept in
+// a LRU cache keyed by the blob id. The commits that changed the task
+// file are kept with the HEAD they were listed from.
+class TaskHistory
+{
+public:
+	TaskHistory(GitBackend *storage, std::string taskFile, size_t cacheSize = 64);
+
+	std::vector<TaskChange> getChanges(unsigned int id);
+	std::vector<TaskDiff> diff(const std::string &from, const std::string &to);
+private:
+	std::vector<GitBackend::FileRevision> getRevisions();
+	std::shared_ptr<const TaskIndex> getIndex(const std::string &blob);
+	static TaskDiff compare(const std::string &before, const std::string &after);
+	static std::string formatValue(const std::string &json);
+
+	typedef std::pair<std::string, std::shared_ptr<const TaskIndex> > CacheEntry;
+
+	GitBackend *mStorage;
+	std::string mTaskFile;
+	size_t mCacheSize;
+	std::list<CacheEntry> mCache;
+	std::map<std::string, std::list<CacheEntry>::iterator> mCacheIndex;
+	std::string mHead;//< the commit that mRevisions has been listed from
+	std::vector<GitBackend::FileRevision> mRevisions;
+	std::mutex mMutex;
+};
+
+};
+};
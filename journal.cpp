@@ -0,0 +1,210 @@
+/* Journal of the saved tasks
+ *
+ * Copyright (C) 2017 Aleksi Salmela
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+namespace Tasker {
+namespace Backend {
+
+static const char *RECORD_PREFIX = "{\"seq\":";
+static const char *TASK_KEY = ",\"task\":";
+
+// Reads the existing records. A record that was not completely written
+// is cut off so that the next record starts from a new line.
+Journal::Journal(std::string path)
+	:mPath(path), mLastSeq(0), mRecords(0), mSize(0)
+{
+	std::ifstream file(mPath, std::ios_base::binary);
+	std::string line;
+	while(file.good()) {
+		std::getline(file, line);
+		Record record;
+		if(file.eof() || !parseLine(line, record) || record.seq <= mLastSeq) {
+			break;
+		}
+		mLastSeq = record.seq;
+		mRecords++;
+		mSize += line.size() + 1;
+	}
+	file.close();
+	if(access(mPath.c_str(), F_OK) == 0) {
+		::truncate(mPath.c_str(), mSize);
+	}
+}
+
+bool Journal::parseLine(const std::string &line, Record &record)
+{
+	size_t prefix = strlen(RECORD_PREFIX);
+	if(line.compare(0, prefix, RECORD_PREFIX) != 0 || line.empty() || line.back() != '}') {
+		return false;
+	}
+	char *end;
+	record.seq = strtoul(line.c_str() + prefix, &end, 10);
+	size_t pos = end - line.c_str();
+	size_t key = strlen(TASK_KEY);
+	if(record.seq == 0 || line.compare(pos, key, TASK_KEY) != 0) {
+		return false;
+	}
+	pos += key;
+	record.task = line.substr(pos, line.size() - pos - 1);
+	return true;
+}
+
+// Returns the records that have greater sequence number than after
+std::vector<Journal::Record> Journal::read(unsigned int after)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	std::vector<Record> records;
+	std::ifstream file(mPath, std::ios_base::binary);
+	std::string line;
+	for(unsigned int i = 0; i < mRecords && std::getline(file, line); i++) {
+		Record record;
+		if(parseLine(line, record) && record.seq > after) {
+			records.push_back(record);
+		}
+	}
+	return records;
+}
+
+// Appends the tasks as one write, returns the sequence number of the
+// last record.
+unsigned int Journal::append(const std::vector<std::shared_ptr<const std::string> > &tasks)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	std::string data;
+	unsigned int seq = mLastSeq;
+	for(const auto &task : tasks) {
+		data += RECORD_PREFIX + std::to_string(++seq) + TASK_KEY + compact(*task) + "}\n";
+	}
+	if(data.empty()) {
+		return mLastSeq;
+	}
+
+	int fd = open(mPath.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if(fd < 0) {
+		throw "Couldn't open the journal";
+	}
+	ssize_t written = write(fd, data.data(), data.size());
+	close(fd);
+	if(written != (ssize_t)data.size()) {
+		::truncate(mPath.c_str(), mSize);
+		throw "Couldn't write the journal";
+	}
+	mLastSeq = seq;
+	mRecords += tasks.size();
+	mSize += data.size();
+	return mLastSeq;
+}
+
+// Removes the records that have been stored to the task file
+void Journal::truncate(unsigned int upto)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	std::ifstream file(mPath, std::ios_base::binary);
+	std::string line, data;
+	unsigned int records = 0;
+	for(unsigned int i = 0; i < mRecords && std::getline(file, line); i++) {
+		Record record;
+		if(parseLine(line, record) && record.seq > upto) {
+			data += line + "\n";
+			records++;
+		}
+	}
+	file.close();
+
+	std::string temp = mPath + ".tmp";
+	FILE *out = fopen(temp.c_str(), "wb");
+	if(!out) {
+		return;
+	}
+	bool written = fwrite(data.data(), 1, data.size(), out) == data.size();
+	written &= fclose(out) == 0;
+	if(!written || rename(temp.c_str(), mPath.c_str())) {
+		unlink(temp.c_str());
+		return;
+	}
+	mRecords = records;
+	mSize = data.size();
+}
+
+// The next records get greater sequence numbers than the seq even if the
+// journal is empty
+void Journal::skipTo(unsigned int seq)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	if(mLastSeq < seq) {
+		mLastSeq = seq;
+	}
+}
+
+unsigned int Journal::getLastSeq()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mLastSeq;
+}
+
+unsigned int Journal::getRecordCount()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mRecords;
+}
+
+size_t Journal::getSize()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mSize;
+}
+
+// Removes the white space outside of the strings so that the record fits
+// on a single line
+std::string Journal::compact(const std::string &json)
+{
+	std::string result;
+	result.reserve(json.size());
+	bool inString = false;
+	for(size_t i = 0; i < json.size(); i++) {
+		char c = json[i];
+		if(inString) {
+			result += c;
+			if(c == '\\' && i + 1 < json.size()) {
+				result += json[++i];
+			} else if(c == '"') {
+				inString = false;
+			}
+		} else if(c == '"') {
+			inString = true;
+			result += c;
+		} else if(c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+			result += c;
+		}
+	}
+	return result;
+}
+
+};
+};
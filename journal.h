@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+namespace Tasker {
+namespace Backend {
+
+// Append only log of the saved tasks. Every record is a single line with
+// a sequence number and the task. The records up to the sequence number
+// stored in the project file are already in the task file so they are
+// not replayed and they are removed when the journal is truncated.
+class Journal
+{
+public:
+	struct Record {
+		unsigned int seq;
+		std::string task;
+	};
+
+	Journal(std::string path);
+
+	std::vector<Record> read(unsigned int after);
+	unsigned int append(const std::vector<std::shared_ptr<const std::string> > &tasks);
+	void truncate(unsigned int upto);
+	void skipTo(unsigned int seq);
+	unsigned int getLastSeq();
+	unsigned int getRecordCount();
+	size_t getSize();
+private:
+	static bool parseLine(const std::string &line, Record &record);
+	static std::string compact(const std::string &json);
+
+	std::string mPath;
+	unsigned int mLastSeq;
+	unsigned int mRecords;
+	size_t mSize;
+	std::mutex mMutex;
+};
+
+};
+};
@@ -0,0 +1,74 @@
+/* Interned names
+ *
+ * Copyright (C) 2017 Aleksi Salmela
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include "symbol.h"
+
+namespace Tasker {
+namespace Backend {
+
+/// Symbol
+
+Symbol::Symbol()
+{
+	static const std::string *empty = SymbolTable::get()->intern("");
+	mName = empty;
+}
+
+Symbol::Symbol(const std::string &name)
+	:mName(SymbolTable::get()->intern(name))
+{
+}
+
+Symbol::Symbol(const char *name)
+	:Symbol(std::string(name))
+{
+}
+
+Symbol Symbol::read(FJson::Reader &in)
+{
+	const std::string *name;
+	in.read(name, *SymbolTable::get());
+	return Symbol(name);
+}
+
+/// SymbolTable
+
+SymbolTable *SymbolTable::get()
+{
+	static SymbolTable table;
+	return &table;
+}
+
+// The elements of an unordered set are never moved so the returned
+// pointer stays valid.
+const std::string *SymbolTable::intern(const std::string &name)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return &*mNames.insert(name).first;
+}
+
+size_t SymbolTable::getSize()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mNames.size();
+}
+
+};
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <unordered_set>
+#include <mutex>
+#include <functional>
+
+#include "fjson/fjson.h"
+
+namespace Tasker {
+namespace Backend {
+
+// Interned name of a user, a type, a state or an event type. Every name
+// has a single copy so equal symbols have the same pointer.
+class Symbol
+{
+public:
+	Symbol();
+	Symbol(const std::string &name);
+	Symbol(const char *name);
+
+	const std::string &str() const {return *mName;};
+	operator const std::string &() const {return *mName;};
+	bool empty() const {return mName->empty();};
+	bool operator==(const Symbol &other) const {return mName == other.mName;};
+	bool operator!=(const Symbol &other) const {return mName != other.mName;};
+	// ordered by the name so that the written files stay stable
+	bool operator<(const Symbol &other) const {return *mName < *other.mName;};
+	size_t hash() const {return std::hash<const std::string*>()(mName);};
+
+	static Symbol read(FJson::Reader &in);
+private:
+	Symbol(const std::string *name) :mName(name) {};
+
+	const std::string *mName;
+};
+
+// The names interned by all projects. The names are never freed, there
+// are only a few of them.
+class SymbolTable : public FJson::Interner
+{
+public:
+	static SymbolTable *get();
+	const std::string *intern(const std::string &name) override;
+	size_t getSize();
+private:
+	std::unordered_set<std::string> mNames;
+	std::mutex mMutex;
+};
+
+};
+};
+
+namespace std {
+template<> struct hash<Tasker::Backend::Symbol> {
+	size_t operator()(const Tasker::Backend::Symbol &symbol) const {return symbol.hash();};
+};
+};
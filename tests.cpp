@@ -18,12 +18,42 @@
  * Boston, MA 02110-1301, USA.
  */
 #include <iostream>
+#include <chrono>
+#include <iterator>
+#include <fstream>
+#include <thread>
 #include <unistd.h>
+#include <ftw.h>
 
 #include "backend.h"
+#include "git.h"
+#include "version.h"
 
 namespace Tasker {
 
+// A type with a start and an end state for the tasks of the tests
+Backend::TaskType *createTestType(Backend::Project *project, Backend::TaskState **endState = NULL)
+{
+	auto *type = new Backend::TaskType(project, "type");
+	auto *start = Backend::TaskState::create(type, "start");
+	auto *end = Backend::TaskState::create(type, "end");
+	type->setStartState(start);
+	type->setEndStates({end});
+	type->setTransition(start, end);
+	if(endState) {
+		*endState = end;
+	}
+	return type;
+}
+
+// Removes the directory made by mkdtemp and everything in it
+void removeTestDir(const char *dir)
+{
+	nftw(dir, [](const char *path, const struct stat *, int, struct FTW *) {
+		return remove(path);
+	}, 16, FTW_DEPTH | FTW_PHYS);
+}
+
 bool dateTest() {
 	bool res = true;
 
@@ -39,6 +69,22 @@ bool dateTest() {
 
 	Backend::Date d3("2017-01-01T00:00:00Z");
 	res &= d3.getMachineTime() == "2017-01-01T00:00:00Z";
+	res &= d3.getTimestamp() == 1483228800;
+
+	// the codec agrees with the C library before and after the epoch
+	for(time_t t = -2000000000; t < 4000000000; t += 12345678) {
+		Backend::Date date(t);
+		char buffer[32];
+		struct tm utc, local;
+		gmtime_r(&t, &utc);
+		strftime(buffer, 32, "%Y-%m-%dT%H:%M:%SZ", &utc);
+		res &= date.getMachineTime() == buffer;
+		res &= Backend::Date(date.getMachineTime()).getTimestamp() == t;
+		localtime_r(&t, &local);
+		strftime(buffer, 32, "%a %j %d.%m.%Y %H:%M", &local);
+		res &= date.getFormattedTime("%a %j %d.%m.%Y %H:%M") == buffer;
+	}
+	res &= Backend::Date("2016-02-29T12:00:00Z").getMachineTime() == "2016-02-29T12:00:00Z";
 
 	return res;
 }
@@ -341,6 +387,1155 @@ bool taskEvents()
 	return res;
 }
 
+bool dirtyTracking()
+{
+	char file[] = "/tmp/tasker-dirty-tracking-XXXXXX";
+	if(!mkdtemp(file)) return false;
+	auto *project = Backend::Project::create(file);
+
+	auto *type = createTestType(project);
+
+	auto *task = new Backend::Task(project, "first");
+	task->setType(type);
+	project->getTaskList()->addTask(task);
+	auto *task2 = new Backend::Task(project, "second");
+	task2->setType(type);
+	project->getTaskList()->addTask(task2);
+
+	project->write();
+	auto stats = project->getSaveStats();
+	bool res = stats.tasksWritten == 2 && stats.filesWritten == 2;
+	res &= !task->isDirty() && !task2->isDirty();
+
+	project->write();
+	stats = project->getSaveStats();
+	res &= stats.tasksWritten == 0 && stats.filesWritten == 0;
+	res &= stats.filesSkipped == 2;
+
+	task2->setName("renamed");
+	res &= task2->isDirty() && !task->isDirty();
+	project->write();
+	stats = project->getSaveStats();
+	res &= stats.tasksWritten == 1 && stats.tasksSkipped == 1;
+	res &= stats.filesWritten == 1 && stats.filesSkipped == 1;
+	delete project;
+
+	project = Backend::Project::open(file);
+	res &= project && project->getType("type");
+	res &= project && project->getTaskList()->getTask(2)->getName() == "renamed";
+	delete project;
+
+	removeTestDir(file);
+	return res;
+}
+
+bool asyncWrite()
+{
+	char file[] = "/tmp/tasker-async-write-XXXXXX";
+	if(!mkdtemp(file)) return false;
+	auto *project = Backend::Project::create(file);
+
+	auto *type = createTestType(project);
+
+	auto *task = new Backend::Task(project, "first");
+	task->setType(type);
+	project->getTaskList()->addTask(task);
+	auto first = project->writeAsync();
+
+	task->setName("renamed");
+	auto second = project->writeAsync();
+	project->flush();
+
+	bool res = first.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+	res &= second.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+	first.get();
+	second.get();
+	delete project;
+
+	project = Backend::Project::open(file);
+	res &= project && project->getTaskList()->getTask(1)->getName() == "renamed";
+	delete project;
+
+	removeTestDir(file);
+	return res;
+}
+
+bool groupCommit()
+{
+	char file[] = "/tmp/tasker-group-commit-XXXXXX";
+	if(!mkdtemp(file)) return false;
+	auto *project = Backend::Project::create(file);
+	project->setGroupCommit(60 * 1000, 1000);
+
+	auto *type = createTestType(project);
+
+	for(int i = 0; i < 50; i++) {
+		auto *task = new Backend::Task(project, "task " + std::to_string(i));
+		task->setType(type);
+		project->getTaskList()->addTask(task);
+		project->write();
+	}
+
+	// nothing is committed before the window ends or flush is called
+	auto *other = Backend::Project::open(file);
+	bool res = !other;
+	delete other;
+
+	project->flush();
+	other = Backend::Project::open(file);
+	res &= other && other->getTaskList()->getSize() == 50;
+	delete other;
+
+	// without a window the saves wait for max pending saves
+	project->setGroupCommit(0, 5);
+	for(int i = 0; i < 5; i++) {
+		project->getTaskList()->getTask(1)->setName("name " + std::to_string(i));
+		project->write();
+		if(i == 3) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			other = Backend::Project::open(file);
+			res &= other && other->getTaskList()->getTask(1)->getName() == "task 0";
+			delete other;
+		}
+	}
+	project->flush();
+	other = Backend::Project::open(file);
+	res &= other && other->getTaskList()->getTask(1)->getName() == "name 4";
+	delete other;
+	delete project;
+
+	removeTestDir(file);
+	return res;
+}
+
+bool maintainRepository()
+{
+	char file[] = "/tmp/tasker-maintain-XXXXXX";
+	if(!mkdtemp(file)) return false;
+	auto *project = Backend::Project::create(file);
+
+	auto *type = createTestType(project);
+	for(int i = 0; i < 10; i++) {
+		auto *task = new Backend::Task(project, "task " + std::to_string(i));
+		task->setType(type);
+		project->getTaskList()->addTask(task);
+		project->write();
+	}
+
+	auto report = project->maintain();
+	bool res = report.looseBefore > 0 && report.looseAfter == 0;
+	res &= report.packed == report.looseBefore;
+	delete project;
+
+	project = Backend::Project::open(file);
+	res &= project && project->getTaskList()->getSize() == 10;
+	delete project;
+
+	removeTestDir(file);
+	return res;
+}
+
+static std::string readGitFile(Backend::GitBackend *git, std::string path)
+{
+	std::streambuf *buf = git->getFile(path);
+	if(!buf) return "";
+	std::string content((std::istreambuf_iterator<char>(buf)), std::istreambuf_iterator<char>());
+	delete buf;
+	return content;
+}
+
+static void writeGitFile(Backend::GitBackend *git, std::string path, std::string content, std::string message = "")
+{
+	std::streambuf *buf = git->addFile(path);
+	std::ostream out(buf);
+	out << content;
+	delete buf;
+	git->commit(message);
+}
+
+bool headCache()
+{
+	char dir[] = "/tmp/tasker-head-cache-XXXXXX";
+	if(!mkdtemp(dir)) return false;
+	auto *writer = Backend::GitBackend::create(dir);
+	auto *reader = Backend::GitBackend::open(dir);
+
+	writeGitFile(writer, "file", "first");
+	bool res = readGitFile(reader, "file") == "first";
+	res &= readGitFile(reader, "file") == "first";
+
+	// the reader has to notice that HEAD moved
+	writeGitFile(writer, "file", "second");
+	res &= readGitFile(reader, "file") == "second";
+	res &= readGitFile(writer, "file") == "second";
+
+	delete reader;
+	delete writer;
+	removeTestDir(dir);
+	return res;
+}
+
+bool parallelReads()
+{
+	char dir[] = "/tmp/tasker-parallel-reads-XXXXXX";
+	if(!mkdtemp(dir)) return false;
+	auto *git = Backend::GitBackend::create(dir);
+	for(int i = 0; i < 8; i++) {
+		std::streambuf *buf = git->addFile("file" + std::to_string(i));
+		std::ostream out(buf);
+		out << "content " << i;
+		delete buf;
+	}
+	git->commit();
+
+	std::atomic<bool> res(true);
+	std::vector<std::thread> readers;
+	for(int t = 0; t < 8; t++) {
+		readers.emplace_back([git, &res]() {
+			for(int n = 0; n < 100; n++) {
+				int i = n % 8;
+				if(readGitFile(git, "file" + std::to_string(i)) != "content " + std::to_string(i)) {
+					res = false;
+				}
+			}
+		});
+	}
+	// writing does not block the readers
+	writeGitFile(git, "other", "other");
+	for(auto &reader : readers) {
+		reader.join();
+	}
+
+	bool written = readGitFile(git, "other") == "other";
+	delete git;
+	removeTestDir(dir);
+	return res && written;
+}
+
+bool taskHistory()
+{
+	char file[] = "/tmp/tasker-history-XXXXXX";
+	if(!mkdtemp(file)) return false;
+	auto *project = Backend::Project::create(file);
+
+	auto *type = createTestType(project);
+
+	auto *task = new Backend::Task(project, "first");
+	task->setType(type);
+	project->getTaskList()->addTask(task);
+	project->write();
+	task->setName("second");
+	project->write();
+	task->setDescription("text");
+	project->write();
+
+	auto changes = project->getTaskHistory(task->getId());
+	bool res = changes.size() == 3;
+	res &= res && changes[0].field == "created" && changes[0].after == "first";
+	res &= res && changes[1].field == "name" && changes[1].before == "first" && changes[1].after == "second";
+	res &= res && changes[2].field == "desc" && changes[2].after == "text\n";
+	delete project;
+
+	auto *old = Backend::Project::openAt(file, "HEAD~2");
+	res &= old && old->getTaskList()->getTask(1)->getName() == "first";
+	try {
+		if(old) old->write();
+		res = false;
+	} catch(const char *e) {
+	}
+	delete old;
+
+	old = Backend::Project::openAt(file, Backend::Date(time(NULL) + 3600));
+	res &= old && old->getTaskList()->getTask(1)->getDescription() == "text\n";
+	delete old;
+	res &= !Backend::Project::openAt(file, Backend::Date((time_t)0));
+
+	// the escaped control characters are decoded
+	project = Backend::Project::open(file);
+	project->getTaskList()->getTask(1)->setName("bell\x07");
+	project->write();
+	changes = project->getTaskHistory(1);
+	res &= changes.size() == 4 && changes[3].after == "bell\x07";
+
+	// the commits listed by the previous query are kept
+	project->getTaskList()->getTask(1)->setName("third");
+	project->write();
+	changes = project->getTaskHistory(1);
+	res &= changes.size() == 5 && changes[4].before == "bell\x07" && changes[4].after == "third";
+	res &= changes[0].field == "created" && changes[1].after == "second";
+	delete project;
+	removeTestDir(file);
+	return res;
+}
+
+bool indexCommits()
+{
+	char source[] = "/tmp/tasker-source-XXXXXX";
+	char file[] = "/tmp/tasker-index-XXXXXX";
+	if(!mkdtemp(source) || !mkdtemp(file)) return false;
+	auto *git = Backend::GitBackend::create(source);
+	auto *project = Backend::Project::create(file);
+
+	auto *type = createTestType(project);
+	for(int i = 0; i < 2; i++) {
+		auto *task = new Backend::Task(project, "task");
+		task->setType(type);
+		project->getTaskList()->addTask(task);
+	}
+
+	writeGitFile(git, "a", "a", "Fix #1 and #2");
+	writeGitFile(git, "b", "b", "Not a reference: #2a");
+
+	bool res = project->setSource(source);
+	res &= project->indexCommits() == 2;
+	res &= project->indexCommits() == 0;
+
+	writeGitFile(git, "c", "c", "More work on #2");
+	res &= project->indexCommits() == 1;
+	auto events = project->getTaskList()->getTask(2)->getEvents();
+	res &= events.size() == 2 && dynamic_cast<Backend::CommitEvent*>(events[1]);
+	project->write();
+	delete project;
+
+	// the indexed commit is stored with the project
+	project = Backend::Project::open(file);
+	res &= project && project->setSource(source) && project->indexCommits() == 0;
+	res &= project && project->getTaskList()->getTask(1)->getEvents().size() == 1;
+	delete project;
+	delete git;
+	removeTestDir(source);
+	removeTestDir(file);
+	return res;
+}
+
+bool inMemoryProject()
+{
+	auto *project = Backend::Project::createInMemory();
+
+	auto *type = createTestType(project);
+
+	auto *task = new Backend::Task(project, "task");
+	task->setType(type);
+	project->getTaskList()->addTask(task);
+	for(int i = 0; i < 1000; i++) {
+		task->setName("task " + std::to_string(i));
+		project->write();
+	}
+
+	auto changes = project->getTaskHistory(task->getId());
+	bool res = changes.size() == 1000;
+	res &= res && changes.back().before == "task 998" && changes.back().after == "task 999";
+	delete project;
+	return res;
+}
+
+bool pullAndPush()
+{
+	char first[] = "/tmp/tasker-pull-XXXXXX";
+	char second[] = "/tmp/tasker-push-XXXXXX";
+	char remote[] = "/tmp/tasker-remote-XXXXXX";
+	if(!mkdtemp(first) || !mkdtemp(second) || !mkdtemp(remote)) return false;
+	auto *ours = Backend::Project::create(first);
+
+	auto *type = createTestType(ours);
+	for(int i = 0; i < 2; i++) {
+		auto *task = new Backend::Task(ours, "task");
+		task->setType(type);
+		ours->getTaskList()->addTask(task);
+	}
+	delete Backend::GitBackend::createRemote(remote);
+	ours->push(remote);
+
+	auto *theirs = Backend::Project::clone(remote, second);
+	bool res = theirs && theirs->getTaskList()->getSize() == 2;
+	if(!res) {
+		delete ours;
+		removeTestDir(first);
+		removeTestDir(second);
+		removeTestDir(remote);
+		return false;
+	}
+
+	// both sides change the same tasks and add a task with the same id
+	auto *tasks = ours->getTaskList();
+	tasks->getTask(1)->setName("our name");
+	tasks->getTask(2)->setName("our conflict");
+	auto *task = new Backend::Task(ours, "our task");
+	task->setType(type);
+	tasks->addTask(task);
+	ours->write();
+
+	tasks = theirs->getTaskList();
+	tasks->getTask(1)->setDescription("their desc");
+	tasks->getTask(2)->setName("their conflict");
+	task = new Backend::Task(theirs, "their task");
+	task->setType(theirs->getType("type"));
+	tasks->addTask(task);
+	theirs->push(remote);
+
+	auto stats = ours->pull(remote);
+	res &= stats.tasksMerged == 2 && stats.conflicts == 1 && stats.tasksRenumbered == 1;
+	res &= stats.tasksRead == 2;
+	tasks = ours->getTaskList();
+	res &= tasks->getSize() == 4;
+	res &= res && tasks->getTask(1)->getName() == "our name";
+	res &= res && tasks->getTask(1)->getDescription().find("their desc") == 0;
+	res &= res && tasks->getTask(2)->getName() == "our conflict";
+	res &= res && tasks->getTask(3)->getName() == "our task";
+	res &= res && tasks->getTask(4)->getName() == "their task" && tasks->getTask(4)->getId() == 4;
+
+	// the merge is a fast forward for them
+	ours->push(remote);
+	theirs->pull(remote);
+	res &= theirs->getTaskList()->getSize() == 4;
+	theirs->push(remote);
+	stats = ours->pull(remote);
+	res &= stats.tasksMerged == 0 && ours->getTaskList()->getSize() == 4;
+
+	// the ids that we removed aren't given to their tasks
+	tasks = ours->getTaskList();
+	for(int i = 0; i < 2; i++) {
+		task = new Backend::Task(ours, "our new task");
+		task->setType(type);
+		tasks->addTask(task);
+	}
+	tasks->removeTask(task);
+	delete task;
+	ours->write();
+	task = new Backend::Task(theirs, "their new task");
+	task->setType(theirs->getType("type"));
+	theirs->getTaskList()->addTask(task);
+	theirs->push(remote);
+	stats = ours->pull(remote);
+	res &= stats.tasksRenumbered == 1 && !tasks->getTask(6) && tasks->getNextId() == 8;
+	res &= tasks->getTask(7) && tasks->getTask(7)->getName() == "their new task";
+	delete ours;
+
+	// a lazily read project parses only the task they changed
+	ours = Backend::Project::open(first, 1 << 20);
+	res &= ours->getTaskList()->getNextId() == 8;
+	ours->push(remote);
+	theirs->pull(remote);
+	theirs->getTaskList()->getTask(7)->setDescription("their new desc");
+	theirs->push(remote);
+	stats = ours->pull(remote);
+	res &= stats.tasksRead == 1 && ours->getTaskList()->getSize() == 6;
+	res &= ours->getTaskList()->getTask(7)->getDescription().find("their new desc") == 0;
+
+	delete theirs;
+	delete ours;
+	removeTestDir(first);
+	removeTestDir(second);
+	removeTestDir(remote);
+	return res;
+}
+
+bool mergeWithoutChanges()
+{
+	char first[] = "/tmp/tasker-pull-XXXXXX";
+	char second[] = "/tmp/tasker-push-XXXXXX";
+	char remote[] = "/tmp/tasker-remote-XXXXXX";
+	if(!mkdtemp(first) || !mkdtemp(second) || !mkdtemp(remote)) return false;
+	auto *ours = Backend::Project::create(first);
+
+	auto *type = createTestType(ours);
+	for(int i = 0; i < 2; i++) {
+		auto *task = new Backend::Task(ours, "task");
+		task->setType(type);
+		ours->getTaskList()->addTask(task);
+	}
+	delete Backend::GitBackend::createRemote(remote);
+	ours->push(remote);
+	auto *theirs = Backend::Project::clone(remote, second);
+
+	// both sides make the same change in different commits
+	ours->getTaskList()->getTask(1)->setName("same");
+	ours->write();
+	std::this_thread::sleep_for(std::chrono::seconds(1));
+	theirs->getTaskList()->getTask(1)->setName("same");
+	theirs->push(remote);
+	auto stats = ours->pull(remote);
+	bool res = stats.conflicts == 0 && ours->getTaskList()->getTask(1)->getName() == "same";
+	ours->push(remote);
+	theirs->pull(remote);
+
+	// the types added on both sides are kept
+	auto *ourType = new Backend::TaskType(ours, "our type");
+	ourType->setStartState(Backend::TaskState::create(ourType, "start"));
+	ourType->setEndStates({ourType->getStartState()});
+	ours->write();
+	auto *theirType = new Backend::TaskType(theirs, "their type");
+	auto *theirState = Backend::TaskState::create(theirType, "start");
+	theirType->setStartState(theirState);
+	theirType->setEndStates({theirState});
+	auto *task = new Backend::Task(theirs, "their task");
+	task->setType(theirType);
+	theirs->getTaskList()->addTask(task);
+	theirs->push(remote);
+	stats = ours->pull(remote);
+	res &= stats.conflicts == 0 && ours->getType("our type") && ours->getType("their type");
+	res &= ours->getTaskList()->getTask(3) && ours->getTaskList()->getTask(3)->getType() == ours->getType("their type");
+	delete theirs;
+
+	// they commit only a file that isn't read by the project
+	ours->push(remote);
+	auto *git = Backend::GitBackend::open(second);
+	git->setHead(git->fetch(remote));
+	auto *buf = git->addFile("notes.txt");
+	{
+		std::ostream stream(buf);
+		stream << "notes\n";
+	}
+	delete buf;
+	git->commit("notes");
+	git->push(remote);
+	delete git;
+	ours->getTaskList()->getTask(2)->setName("ours");
+	ours->write();
+	stats = ours->pull(remote);
+	res &= stats.conflicts == 0 && ours->getTaskList()->getTask(2)->getName() == "ours";
+	stats = ours->pull(remote);
+	res &= stats.tasksMerged == 0;
+	delete ours;
+	removeTestDir(first);
+	removeTestDir(second);
+	removeTestDir(remote);
+	return res;
+}
+
+bool diffRevisions()
+{
+	auto *project = Backend::Project::createInMemory();
+
+	auto *type = createTestType(project);
+	for(int i = 0; i < 3; i++) {
+		auto *task = new Backend::Task(project, "task");
+		task->setType(type);
+		project->getTaskList()->addTask(task);
+	}
+	project->write();
+
+	auto *tasks = project->getTaskList();
+	tasks->getTask(1)->setName("renamed");
+	tasks->getTask(2)->addEvent(new Backend::CommentEvent(tasks->getTask(2), "Hello"));
+	auto *task = new Backend::Task(project, "new");
+	task->setType(type);
+	tasks->addTask(task);
+	project->write();
+
+	auto diffs = project->diff("HEAD~1", "HEAD");
+	bool res = diffs.size() == 3;
+	res &= res && diffs[0].id == 1 && diffs[0].kind == Backend::TaskDiff::MODIFIED;
+	res &= res && diffs[0].fields.size() == 1 && diffs[0].fields[0] == "name" && diffs[0].events.empty();
+	res &= res && diffs[1].id == 2 && diffs[1].fields.empty();
+	res &= res && diffs[1].events.size() == 1 && diffs[1].events[0] == "COMMENT";
+	res &= res && diffs[2].id == 4 && diffs[2].kind == Backend::TaskDiff::ADDED && diffs[2].name == "new";
+
+	diffs = project->diff("HEAD", "HEAD~1");
+	res &= diffs.size() == 3 && diffs[2].kind == Backend::TaskDiff::REMOVED;
+	res &= project->diff("HEAD", "HEAD").empty();
+	delete project;
+	return res;
+}
+
+bool snapshotCache()
+{
+	char file[] = "/tmp/tasker-cache-XXXXXX";
+	if(!mkdtemp(file)) return false;
+	auto *project = Backend::Project::create(file);
+
+	Backend::TaskState *endState;
+	auto *type = createTestType(project, &endState);
+	auto *task = new Backend::Task(project, "task");
+	task->setType(type);
+	project->getTaskList()->addTask(task);
+	auto *subTask = new Backend::Task(project, "sub task");
+	subTask->setType(type);
+	task->addSubTask(subTask);
+	task->addEvent(new Backend::CommentEvent(task, "Hello"));
+	task->setState(endState);
+	project->write();
+	delete project;
+
+	// unknown fields have to survive the cache
+	auto *git = Backend::GitBackend::open(file);
+	std::string tasks = readGitFile(git, "tasks.json");
+	size_t pos = tasks.rfind("\"events\"");
+	tasks.insert(pos, "\"extra\": {\"a\": [1, 2.5, true, null, \"x\"]},\n\t\t");
+	writeGitFile(git, "tasks.json", tasks, "extra");
+	delete git;
+
+	std::string cachePath = std::string(file) + "/.git/tasker-cache/snapshot";
+	project = Backend::Project::open(file);
+	bool res = project && access(cachePath.c_str(), F_OK) == 0;
+	std::string parsed = res ? *project->getTaskList()->getTask(1)->serialize() : "";
+	delete project;
+
+	project = Backend::Project::open(file);
+	res &= project && *project->getTaskList()->getTask(1)->serialize() == parsed;
+	res &= parsed.find("extra") != std::string::npos;
+	res &= project && project->getType("type")->isClosed(project->getTaskList()->getTask(1)->getState());
+
+	// a stale cache is not used
+	project->getTaskList()->getTask(1)->setName("renamed");
+	project->write();
+	delete project;
+	project = Backend::Project::open(file);
+	res &= project && project->getTaskList()->getTask(1)->getName() == "renamed";
+	delete project;
+
+	// neither is a broken one
+	truncate(cachePath.c_str(), 64);
+	project = Backend::Project::open(file);
+	res &= project && project->getTaskList()->getTask(1)->getName() == "renamed";
+	delete project;
+	removeTestDir(file);
+	return res;
+}
+
+bool lazyTasks()
+{
+	char file[] = "/tmp/tasker-lazy-XXXXXX";
+	if(!mkdtemp(file)) return false;
+	auto *project = Backend::Project::create(file);
+
+	auto *type = createTestType(project);
+	for(int i = 0; i < 20; i++) {
+		auto *task = new Backend::Task(project, "task " + std::to_string(i));
+		task->setType(type);
+		task->setDescription("description " + std::to_string(i));
+		task->addEvent(new Backend::CommentEvent(task, "comment"));
+		project->getTaskList()->addTask(task);
+	}
+	auto *subTask = new Backend::Task(project, "sub task");
+	subTask->setType(type);
+	project->getTaskList()->getTask(1)->addSubTask(subTask);
+	project->write();
+	delete project;
+
+	// the budget fits only a single body
+	project = Backend::Project::open(file, 1);
+	auto *tasks = project->getTaskList();
+	bool res = tasks->getSize() == 20 && tasks->getTask(2)->getName() == "task 1";
+	res &= tasks->findTask("1.1") && tasks->findTask("1.1")->getName() == "sub task";
+	res &= !tasks->getTask(2)->getLastActivity().getMachineTime().empty();
+
+	// publishing copies the bodies that aren't loaded
+	project->publish();
+	auto first = project->getVersion()->getTask(5);
+	res &= first->description.find("description 4") == 0 && first->events->size() == 1;
+	res &= (*first->events)[0].text.find("comment") == 0;
+
+	tasks->getTask(3)->setDescription("changed");
+	for(int round = 0; round < 2; round++) {
+		for(unsigned int id = 1; id <= 20; id++) {
+			auto *task = tasks->getTask(id);
+			std::string desc = id == 3 ? "changed" : "description " + std::to_string(id - 1) + "\n";
+			res &= task->getDescription().find(desc) == 0;
+			res &= task->getEvents().size() == 1;
+		}
+	}
+	res &= tasks->getTask(1)->getSubTasks().size() == 1;
+	res &= tasks->findTask("1.1") == tasks->getTask(1)->getSubTasks()[0];
+	project->write();
+
+	// the written task is read back from the saved version
+	tasks->getTask(3)->getEvents();
+	for(unsigned int id = 1; id <= 20; id++) {
+		tasks->getTask(id)->getDescription();
+	}
+	res &= tasks->getTask(3)->getDescription().find("changed") == 0;
+
+	auto *eager = Backend::Project::open(file);
+	for(unsigned int id = 1; id <= 20; id++) {
+		res &= *tasks->getTask(id)->serialize() == *eager->getTaskList()->getTask(id)->serialize();
+	}
+	delete eager;
+
+	// reading the bodies again doesn't change the published tasks
+	project->publish();
+	auto version = project->getVersion();
+	for(unsigned int id = 1; id <= 20; id++) {
+		tasks->getTask(id)->getDescription();
+	}
+	project->publish();
+	for(unsigned int id = 1; id <= 20; id++) {
+		res &= version->getTask(id) == project->getVersion()->getTask(id);
+	}
+
+	// a renamed task shares the body with the previous copy
+	tasks->getTask(5)->setName("renamed");
+	project->publish();
+	res &= project->getVersion()->getTask(5)->name == "renamed";
+	res &= project->getVersion()->getTask(5)->events == version->getTask(5)->events;
+	delete project;
+	removeTestDir(file);
+	return res;
+}
+
+bool deleteLoadedBody()
+{
+	char file[] = "/tmp/tasker-lazy-delete-XXXXXX";
+	if(!mkdtemp(file)) return false;
+	auto *project = Backend::Project::create(file);
+	auto *type = createTestType(project);
+	for(int i = 0; i < 5; i++) {
+		auto *task = new Backend::Task(project, "task " + std::to_string(i));
+		task->setType(type);
+		task->setDescription("description " + std::to_string(i));
+		project->getTaskList()->addTask(task);
+	}
+	project->write();
+	delete project;
+
+	project = Backend::Project::open(file, 1 << 20);
+	auto *tasks = project->getTaskList();
+	for(unsigned int id = 1; id <= 5; id++) {
+		tasks->getTask(id)->getDescription();
+	}
+	auto *removed = tasks->getTask(2);
+	tasks->removeTask(removed);
+	delete removed;
+	auto *replaced = new Backend::Task(project, "replaced");
+	replaced->setId(3);
+	tasks->setTask(replaced);
+
+	// the deleted bodies aren't evicted
+	project->setBodyBudget(1);
+	bool res = tasks->getTask(4)->getDescription().find("description 3") == 0;
+	res &= tasks->getTask(1)->getDescription().find("description 0") == 0;
+	res &= tasks->getSize() == 4 && tasks->getTask(3)->getName() == "replaced";
+	delete project;
+	removeTestDir(file);
+	return res;
+}
+
+bool journal()
+{
+	char file[] = "/tmp/tasker-journal-XXXXXX";
+	if(!mkdtemp(file)) return false;
+	auto *project = Backend::Project::create(file);
+
+	auto *type = createTestType(project);
+	for(int i = 0; i < 2; i++) {
+		auto *task = new Backend::Task(project, "task");
+		task->setType(type);
+		project->getTaskList()->addTask(task);
+	}
+	project->write();
+
+	// the change is only in the journal
+	project->setJournal(3);
+	project->getTaskList()->getTask(1)->setName("journaled");
+	project->write();
+	auto *git = Backend::GitBackend::open(file);
+	bool res = readGitFile(git, "tasks.json").find("journaled") == std::string::npos;
+	delete project;
+
+	project = Backend::Project::open(file);
+	auto *tasks = project->getTaskList();
+	res &= tasks->getSize() == 2 && tasks->getTask(1)->getName() == "journaled";
+
+	// the full journal is compacted to the task file
+	project->setJournal(3);
+	auto *task = tasks->getTask(2);
+	task->addEvent(new Backend::CommentEvent(task, "first"));
+	project->write();
+	task->addEvent(new Backend::CommentEvent(task, "second"));
+	project->write();
+	task->setName("compacted");
+	project->write();
+	project->flush();
+	std::string stored = readGitFile(git, "tasks.json");
+	res &= stored.find("journaled") != std::string::npos && stored.find("compacted") != std::string::npos;
+
+	tasks->getTask(1)->setName("after compaction");
+	project->write();
+	delete project;
+
+	project = Backend::Project::open(file);
+	tasks = project->getTaskList();
+	res &= tasks->getSize() == 2 && tasks->getTask(1)->getName() == "after compaction";
+	res &= tasks->getTask(2)->getName() == "compacted" && tasks->getTask(2)->getEvents().size() == 2;
+
+	// the journal is committed when the journal isn't used any more
+	project->write();
+	res &= readGitFile(git, "tasks.json").find("after compaction") != std::string::npos;
+	delete project;
+	delete git;
+	removeTestDir(file);
+	return res;
+}
+
+bool atomicWrite()
+{
+	char dir[] = "/tmp/tasker-atomic-XXXXXX";
+	if(!mkdtemp(dir)) return false;
+	std::string path = std::string(dir) + "/file";
+	auto readFile = [](const std::string &path) {
+		std::ifstream in(path, std::ios_base::binary);
+		return std::string(std::istreambuf_iterator<char>(in), {});
+	};
+
+	auto *buf = new Backend::AtomicFileBuffer(path);
+	std::ostream(buf) << "first";
+	buf->commit();
+	delete buf;
+	bool res = readFile(path) == "first";
+
+	// the file isn't replaced without commit
+	buf = new Backend::AtomicFileBuffer(path);
+	std::ostream(buf) << "second";
+	delete buf;
+	res &= readFile(path) == "first" && access((path + ".tmp").c_str(), F_OK) != 0;
+
+	// the preallocated space is cut to the written data
+	std::string data(Backend::AtomicFileBuffer::BUFFER_SIZE + 100, 'x');
+	buf = new Backend::AtomicFileBuffer(path, Backend::AtomicFileBuffer::DIRECT_THRESHOLD);
+	std::ostream(buf) << data;
+	buf->commit();
+	delete buf;
+	res &= readFile(path) == data;
+	unlink(path.c_str());
+	rmdir(dir);
+	return res;
+}
+
+bool internedNames()
+{
+	Backend::Symbol a("name"), b(std::string("na") + "me");
+	bool res = a == b && &a.str() == &b.str() && a != Backend::Symbol("other");
+	res &= Backend::Symbol().empty() && Backend::Symbol("") == Backend::Symbol();
+
+	// the reader interns the string without a copy
+	std::stringstream json("[\"name\", null]");
+	FJson::Reader in(json);
+	const std::string *first, *second;
+	in.startArray();
+	in.hasNextElement();
+	in.read(first, *Backend::SymbolTable::get());
+	in.hasNextElement();
+	in.read(second, *Backend::SymbolTable::get());
+	res &= first == &a.str() && second == &Backend::Symbol().str();
+
+	// the names read from the files are the same symbols
+	char file[] = "/tmp/tasker-symbols-XXXXXX";
+	if(!mkdtemp(file)) return false;
+	auto *project = Backend::Project::create(file);
+	auto *type = createTestType(project);
+	for(int i = 0; i < 2; i++) {
+		auto *task = new Backend::Task(project, "task");
+		task->setType(type);
+		task->setAssigned(project->getUser("user"));
+		project->getTaskList()->addTask(task);
+	}
+	project->write();
+	delete project;
+
+	project = Backend::Project::open(file);
+	auto *list = project->getTaskList();
+	size_t symbols = Backend::SymbolTable::get()->getSize();
+	res &= list->getTask(1)->getAssigned() == list->getTask(2)->getAssigned();
+	res &= list->getTask(1)->getAssigned() == project->getUser(std::string("user"));
+	res &= list->getTask(1)->getState()->getSymbol() == "start";
+	res &= Backend::SymbolTable::get()->getSize() == symbols;
+	delete project;
+	removeTestDir(file);
+	return res;
+}
+
+bool arenaAllocation()
+{
+	Backend::Arena arena;
+	std::vector<Backend::Task*> tasks;
+	{
+		Backend::Arena::Scope scope(&arena);
+		for(int i = 0; i < 1000; i++) {
+			auto *task = new Backend::Task(NULL, "task");
+			task->addSubTask(new Backend::Task(NULL, "sub task"));
+			tasks.push_back(task);
+		}
+	}
+	bool res = arena.getBlockCount() <= 4;
+
+	// the freed memory is reused
+	Backend::Task *last = tasks.back();
+	tasks.pop_back();
+	delete last;
+	{
+		Backend::Arena::Scope scope(&arena);
+		tasks.push_back(new Backend::Task(NULL, "task"));
+	}
+	res &= tasks.back() == last;
+	// outside of the scope the tasks come from the heap
+	auto *heapTask = new Backend::Task(NULL, "task");
+	delete heapTask;
+	for(auto task : tasks) {
+		delete task;
+	}
+
+	Backend::SmallVector<int, 4> values;
+	for(int i = 0; i < 10; i++) {
+		values.push_back(i);
+	}
+	Backend::SmallVector<int, 4> copy = values;
+	std::vector<int> vector = copy;
+	res &= copy.size() == 10 && copy.back() == 9 && vector[5] == 5;
+	return res;
+}
+
+bool eventKinds()
+{
+	Backend::Project project;
+	auto *task = new Backend::Task(&project, "task");
+	task->addEvent(new Backend::CommentEvent(task, "comment"));
+	task->addEvent(new Backend::CommitEvent(task, "abc", Backend::Date()));
+	auto events = task->getEvents();
+	bool res = events[0]->getKind() == Backend::TaskEvent::COMMENT;
+	res &= events[0]->as<Backend::CommentEvent>()->getContent() == "comment";
+	res &= !events[0]->as<Backend::CommitEvent>() && events[1]->as<Backend::CommitEvent>();
+	res &= events[1]->getName() == "COMMIT_REF";
+
+	// the events are created by the stored name
+	std::stringstream json;
+	{
+		FJson::Writer out(json);
+		out.startArray();
+		for(auto *event : events) {
+			out.startNextElement();
+			event->write(out);
+		}
+		out.endArray();
+	}
+	FJson::Reader in(json);
+	in.startArray();
+	for(auto *event : events) {
+		in.hasNextElement();
+		auto *read = Backend::TaskEvent::read(&project, in);
+		res &= read->getKind() == event->getKind() && read->getName() == event->getName();
+		delete read;
+	}
+	delete task;
+	return res;
+}
+
+bool eventFieldOrder()
+{
+	Backend::Project project;
+	// the fields before the type are buffered until the type is known
+	std::stringstream json("{\"content\": [\"text\\n\"], \"extra\": [1, 2],"
+		" \"type\": \"COMMENT\", \"date\": \"2017-04-23T14:51:00Z\", \"other\": true}");
+	FJson::Reader in(json);
+	auto *event = Backend::TaskEvent::read(&project, in);
+	auto *comment = event->as<Backend::CommentEvent>();
+	bool res = comment && comment->getContent() == "text\n";
+	res &= event->getCreationDate().getMachineTime() == "2017-04-23T14:51:00Z";
+
+	// the unknown fields are kept with their keys
+	std::stringstream out;
+	{
+		FJson::Writer writer(out);
+		event->write(writer);
+	}
+	res &= out.str().find("\"extra\":[1,2]") != std::string::npos;
+	res &= out.str().find("\"other\":true") != std::string::npos;
+	delete event;
+	return res;
+}
+
+bool textCodec()
+{
+	auto encode = [](const std::string &text) {
+		std::stringstream json;
+		FJson::Writer out(json);
+		Backend::Project::writeText(out, text);
+		return json.str();
+	};
+	auto decode = [](const std::string &json) {
+		std::stringstream stream(json);
+		FJson::Reader in(stream);
+		return Backend::Project::readText(in);
+	};
+
+	// the format is an array of lines that end with a line feed
+	bool res = encode("first\n\nthird") == "[\"first\\n\",\"\\n\",\"third\\n\"]";
+	res &= encode("") == "[]" && decode("[]").empty() && decode("null").empty();
+	res &= decode("[\"first\\n\",\"\\n\",\"third\\n\"]") == "first\n\nthird\n";
+
+	std::string text = "quote \" and \\ back\tslash\n\x01control \u00e4\n";
+	res &= decode(encode(text)) == text;
+	return res;
+}
+
+bool stableTaskIds()
+{
+	char file[] = "/tmp/tasker-ids-XXXXXX";
+	if(!mkdtemp(file)) return false;
+	auto *project = Backend::Project::create(file);
+	auto *type = createTestType(project);
+	auto *list = project->getTaskList();
+	for(int i = 0; i < 100; i++) {
+		auto *task = new Backend::Task(project, "task");
+		task->setType(type);
+		list->addTask(task);
+	}
+
+	// the ids of the removed tasks are not reused
+	for(unsigned int id = 2; id <= 100; id += 2) {
+		auto *task = list->getTask(id);
+		list->removeTask(task);
+		delete task;
+	}
+	bool res = list->getSize() == 50 && !list->getTask(100) && list->getTask(99)->getId() == 99;
+	auto *task = new Backend::Task(project, "new");
+	task->setType(type);
+	list->addTask(task);
+	res &= task->getId() == 101 && list->getTask(101) == task;
+	list->removeTask(task);
+	delete task;
+	project->write();
+	delete project;
+
+	project = Backend::Project::open(file);
+	list = project->getTaskList();
+	res &= list->getSize() == 50 && list->getNextId() == 102 && list->getTask(51)->getId() == 51;
+	delete project;
+	removeTestDir(file);
+	return res;
+}
+
+bool taskTree()
+{
+	Backend::Project project;
+	auto *list = project.getTaskList();
+	for(int i = 0; i < 2; i++) {
+		list->addTask(new Backend::Task(&project, "task"));
+	}
+	auto *parent = new Backend::Task(&project, "parent");
+	list->getTask(1)->addSubTask(parent);
+	parent->addSubTask(new Backend::Task(&project, "first"));
+	bool res = list->findTask("1.1") == parent && !list->findTask("1.1.2");
+
+	// the tree is built again after a new sub-task
+	auto *deep = new Backend::Task(&project, "deep needle");
+	parent->addSubTask(deep);
+	const auto &tree = list->getTree();
+	res &= list->findTask("#1.1.2") == deep && tree.getPath(deep) == "1.1.2";
+	res &= tree.getNodes().size() == 5;
+	auto *node = tree.find("1");
+	res &= node->parent == -1 && node->end == 4 && tree.find("1.1.2")->parent == 1;
+
+	auto *filter = Backend::TaskFilter::search("needle");
+	auto found = tree.getFiltered(filter);
+	res &= found.size() == 1 && found[0]->task == deep;
+	delete filter;
+	return res;
+}
+
+bool taskColumns()
+{
+	Backend::Project project;
+	Backend::TaskState *endState;
+	auto *type = createTestType(&project, &endState);
+	auto *state = type->getStartState();
+	auto *list = project.getTaskList();
+	for(int i = 0; i < 10; i++) {
+		auto *task = new Backend::Task(&project, "task");
+		task->setType(type);
+		list->addTask(task);
+	}
+	auto *open = Backend::TaskFilter::isOpen(true);
+	auto *ended = Backend::TaskFilter::hasState("end");
+	bool res = list->getFiltered(open).size() == 10 && list->getFiltered(ended).empty();
+
+	// the columns follow the changes of the tasks
+	list->getTask(3)->setState(endState);
+	list->getTask(3)->addEvent(new Backend::CommitEvent(list->getTask(3), "abc", Backend::Date(time(NULL) + 3600)));
+	res &= list->getFiltered(open).size() == 9;
+	auto found = list->getFiltered(ended);
+	res &= found.size() == 1 && found[0]->getId() == 3;
+	auto *either = Backend::TaskFilter::orOf(Backend::TaskFilter::notOf(open->clone()), ended->clone());
+	res &= list->getFiltered(either).size() == 1;
+
+	const auto &tree = list->getTree();
+	auto nodes = tree.getFiltered(open);
+	nodes.push_back(tree.find("3"));
+	tree.sortByActivity(nodes);
+	res &= nodes.size() == 10 && nodes[0]->task->getId() == 3;
+
+	// changing the end states of the type changes the open tasks
+	type->setEndStates({state});
+	res &= list->getFiltered(open).size() == 1;
+	delete open;
+	delete ended;
+	delete either;
+	return res;
+}
+
+bool projectVersions()
+{
+	Backend::Project project;
+	auto *list = project.getTaskList();
+	for(int i = 0; i < 3; i++) {
+		list->addTask(new Backend::Task(&project, "task"));
+	}
+	auto *sub = new Backend::Task(&project, "sub");
+	list->getTask(2)->addSubTask(sub);
+	project.publish();
+	auto first = project.getVersion();
+
+	// a reader keeps searching while the writer publishes new versions
+	bool readerOk = true;
+	std::thread reader([&]() {
+		unsigned int number = 0;
+		for(int i = 0; i < 1000; i++) {
+			auto version = project.getVersion();
+			readerOk &= version->getNumber() >= number && version->getTasks().size() == 3;
+			readerOk &= version->search("task").size() == 3;
+			number = version->getNumber();
+		}
+	});
+	for(int i = 0; i < 100; i++) {
+		list->getTask(1)->setName("renamed task");
+		project.publish();
+	}
+	reader.join();
+
+	sub->setDescription("needle");
+	project.publish();
+	auto last = project.getVersion();
+	bool res = readerOk && first->getNumber() == 1 && last->getNumber() == 102;
+	res &= first->getTask(1)->name == "task" && last->getTask(1)->name == "renamed task";
+	res &= first->getTask(3) == last->getTask(3) && first->getTask(2) != last->getTask(2);
+	res &= first->getTask(2)->subTasks[0]->description.empty();
+	res &= last->getTask(2)->subTasks[0]->description == "needle";
+
+	// renaming a state copies the tasks that are in the state
+	auto *type = createTestType(&project);
+	auto *state = type->getStartState();
+	sub->setType(type);
+	project.publish();
+	last = project.getVersion();
+	state->rename("begin");
+	project.publish();
+	res &= last->getTask(2)->subTasks[0]->state == "start";
+	res &= project.getVersion()->getTask(2)->subTasks[0]->state == "begin";
+	res &= project.getVersion()->getTask(1) == last->getTask(1);
+
+	// the events are copied and shared until the body changes
+	auto *task = list->getTask(3);
+	task->addEvent(new Backend::CommentEvent(task, "note"));
+	project.publish();
+	last = project.getVersion();
+	task->setName("renamed");
+	project.publish();
+	auto events = project.getVersion()->getTask(3)->events;
+	res &= events == last->getTask(3)->events && events->size() == 1;
+	res &= (*events)[0].kind == Backend::TaskEvent::COMMENT && (*events)[0].text == "note";
+	res &= first->getTask(3)->events->empty();
+	return res;
+}
+
 bool openTestProject()
 {
 	auto *project = Backend::Project::open("resources/test1/");
@@ -384,6 +1579,84 @@ int testMain()
 	success = taskEvents();
 	std::cout << (success ? "Success" : "Failure") << "\n";
 
+	success = dirtyTracking();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = asyncWrite();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = groupCommit();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = maintainRepository();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = headCache();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = parallelReads();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = taskHistory();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = indexCommits();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = inMemoryProject();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = pullAndPush();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = mergeWithoutChanges();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = diffRevisions();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = snapshotCache();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = lazyTasks();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = deleteLoadedBody();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = journal();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = atomicWrite();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = internedNames();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = arenaAllocation();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = eventKinds();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = eventFieldOrder();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = textCodec();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = stableTaskIds();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = taskTree();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = taskColumns();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
+	success = projectVersions();
+	std::cout << (success ? "Success" : "Failure") << "\n";
+
 	success = openTestProject();
 	std::cout << (success ? "Success" : "Failure") << "\n";
 	return 0;
@@ -0,0 +1,162 @@
+/* Published versions of the project tasks
+ *
+ * Copyright (C) 2017 Aleksi Salmela
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <algorithm>
+#include <sstream>
+
+#include "version.h"
+
+namespace Tasker {
+namespace Backend {
+
+static std::string lower(std::string str)
+{
+	std::transform(str.begin(), str.end(), str.begin(), ::tolower);
+	return str;
+}
+
+ProjectVersion::ProjectVersion()
+	:mNumber(0)
+{
+}
+
+unsigned int ProjectVersion::getNumber() const
+{
+	return mNumber;
+}
+
+const std::vector<std::shared_ptr<const TaskRecord> > &ProjectVersion::getTasks() const
+{
+	return mTasks;
+}
+
+std::shared_ptr<const TaskRecord> ProjectVersion::getTask(unsigned int id) const
+{
+	auto index = mIndex.find(id);
+	return index != mIndex.end() ? mTasks[index->second] : NULL;
+}
+
+// Top level tasks that have the query in their name or description
+std::vector<std::shared_ptr<const TaskRecord> > ProjectVersion::search(const std::string &query) const
+{
+	std::string needle = lower(query);
+	std::vector<std::shared_ptr<const TaskRecord> > found;
+	for(const auto &task : mTasks) {
+		if(lower(task->name).find(needle) != std::string::npos
+			|| lower(task->description).find(needle) != std::string::npos) {
+			found.push_back(task);
+		}
+	}
+	return found;
+}
+
+// Called by the writer. The tasks that haven't changed since the previous
+// version are not copied again.
+std::shared_ptr<const ProjectVersion> ProjectVersion::build(const ProjectVersion &previous,
+	const std::vector<Task*> &tasks)
+{
+	auto version = std::make_shared<ProjectVersion>();
+	version->mNumber = previous.mNumber + 1;
+	version->mTasks.reserve(tasks.size());
+	version->mChangeCounts.reserve(tasks.size());
+	version->mBodyChangeCounts.reserve(tasks.size());
+	for(auto task : tasks) {
+		auto old = previous.mIndex.find(task->getId());
+		if(old == previous.mIndex.end()) {
+			version->mTasks.push_back(createRecord(task, NULL));
+		} else if(previous.mChangeCounts[old->second] == task->getChangeCount()) {
+			version->mTasks.push_back(previous.mTasks[old->second]);
+		} else if(previous.mBodyChangeCounts[old->second] == task->getBodyChangeCount()) {
+			version->mTasks.push_back(createRecord(task, previous.mTasks[old->second].get()));
+		} else {
+			version->mTasks.push_back(createRecord(task, NULL));
+		}
+		version->mChangeCounts.push_back(task->getChangeCount());
+		version->mBodyChangeCounts.push_back(task->getBodyChangeCount());
+		version->mIndex[task->getId()] = version->mTasks.size() - 1;
+	}
+	return version;
+}
+
+// Copies the metadata of the task, the body is shared with the given
+// record if there is one. Otherwise a body that isn't loaded is parsed
+// into a detached task so that publishing doesn't change the loaded
+// bodies of the project. The bodies that aren't loaded have no
+// sub-tasks.
+std::shared_ptr<const TaskRecord> ProjectVersion::createRecord(Task *task, const TaskRecord *body)
+{
+	auto record = std::make_shared<TaskRecord>();
+	record->id = task->getId();
+	record->name = task->getName();
+	if(task->getType()) {
+		record->type = task->getType()->getName();
+		record->state = task->getState()->getSymbol();
+		record->open = !task->isClosed();
+	} else {
+		record->open = true;
+	}
+	record->assigned = task->getAssigned() ? task->getAssigned()->getName() : "";
+	record->created = task->getCreationDate();
+	record->activity = task->getLastActivity();
+	if(body) {
+		record->description = body->description;
+		record->events = body->events;
+		record->subTasks = body->subTasks;
+	} else if(task->mBodySource && !task->mBodyLoaded) {
+		Task detached(task->mProject, "");
+		detached.mType = task->mType;
+		std::istringstream stream(task->mBodySource->substr(task->mBodyOffset, task->mBodyLength));
+		FJson::Reader in(stream);
+		detached.readFields(in, Task::BODY);
+		copyBody(record.get(), &detached);
+	} else {
+		copyBody(record.get(), task);
+	}
+	return record;
+}
+
+void ProjectVersion::copyBody(TaskRecord *record, const Task *task)
+{
+	record->description = task->mDesc;
+	auto events = std::make_shared<std::vector<EventRecord> >();
+	events->reserve(task->mEvents.size());
+	for(auto event : task->mEvents) {
+		EventRecord copy;
+		copy.kind = event->getKind();
+		copy.user = event->getUser() ? event->getUser()->getName() : "";
+		copy.date = event->getCreationDate();
+		if(auto *change = event->as<StateChangeEvent>()) {
+			copy.from = change->from() ? change->from()->getSymbol() : Symbol();
+			copy.to = change->to() ? change->to()->getSymbol() : Symbol();
+		} else if(auto *comment = event->as<CommentEvent>()) {
+			copy.text = comment->getContent();
+		} else if(auto *commit = event->as<CommitEvent>()) {
+			copy.text = commit->getCommit();
+		}
+		events->push_back(copy);
+	}
+	record->events = events;
+	for(auto subTask : task->mSubTasks) {
+		record->subTasks.push_back(createRecord(subTask, NULL));
+	}
+}
+
+};
+};
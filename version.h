@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+
+#include "backend.h"
+
+namespace Tasker {
+namespace Backend {
+
+// Read-only copy of a task event
+struct EventRecord {
+	TaskEvent::Kind kind;
+	std::string user;
+	Date date;
+	Symbol from, to;//< the states of a state change
+	std::string text;//< the content of a comment or the commit of a commit reference
+};
+
+// Read-only copy of a task in a project version
+struct TaskRecord {
+	unsigned int id;
+	std::string name;
+	std::string description;
+	Symbol type;
+	Symbol state;
+	std::string assigned;//< empty if the task isn't assigned
+	bool open;
+	Date created;
+	Date activity;
+	std::shared_ptr<const std::vector<EventRecord> > events;
+	std::vector<std::shared_ptr<const TaskRecord> > subTasks;
+};
+
+// State of the project tasks at the moment of a publish. A version is
+// never changed after it has been published so the readers don't need
+// locks while they use it. The tasks that didn't change share their
+// records with the previous version and the tasks whose body didn't
+// change share the description, the events and the sub-tasks.
+class ProjectVersion
+{
+public:
+	ProjectVersion();
+
+	unsigned int getNumber() const;
+	const std::vector<std::shared_ptr<const TaskRecord> > &getTasks() const;
+	std::shared_ptr<const TaskRecord> getTask(unsigned int id) const;
+	std::vector<std::shared_ptr<const TaskRecord> > search(const std::string &query) const;
+
+	static std::shared_ptr<const ProjectVersion> build(const ProjectVersion &previous,
+		const std::vector<Task*> &tasks);
+private:
+	static std::shared_ptr<const TaskRecord> createRecord(Task *task, const TaskRecord *body);
+	static void copyBody(TaskRecord *record, const Task *task);
+
+	unsigned int mNumber;
+	std::vector<std::shared_ptr<const TaskRecord> > mTasks;
+	std::vector<uint64_t> mChangeCounts;//< of the tasks when they were copied
+	std::vector<uint64_t> mBodyChangeCounts;
+	std::unordered_map<unsigned int, size_t> mIndex;
+};
+
+};
+};